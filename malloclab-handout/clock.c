@@ -9,8 +9,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/times.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
 #include "clock.h"
 
 
@@ -72,6 +76,59 @@ double get_counter()
 }
 /* $end x86cyclecounter */
 
+/* CPUID.80000007H:EDX[8] says the TSC is invariant */
+int tsc_invariant(void)
+{
+    unsigned eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0x80000000, NULL) < 0x80000007 ||
+	!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+	return 0;
+    return (edx >> 8) & 1;
+}
+
+#define TSC_CALIB_RUNS 5          /* calibrations, the median is used */
+#define TSC_CALIB_NS   20000000   /* length of one calibration */
+
+static double elapsed_ns(const struct timespec *t0, const struct timespec *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) * 1e9 + (t1->tv_nsec - t0->tv_nsec);
+}
+
+/*
+ * tsc_mhz - Count TSC ticks over TSC_CALIB_NS of CLOCK_MONOTONIC_RAW,
+ * TSC_CALIB_RUNS times, and return the median rate. Each end reads the
+ * TSC right after clock_gettime, so the error is the jitter of one
+ * clock_gettime call over 20 ms, well below 0.1%.
+ */
+double tsc_mhz(int verbose)
+{
+    struct timespec t0, t1;
+    double c0, rates[TSC_CALIB_RUNS], tmp;
+    int i, j;
+
+    for (i = 0; i < TSC_CALIB_RUNS; i++) {
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+	start_counter();
+	c0 = get_counter();
+	do {
+	    clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+	} while (elapsed_ns(&t0, &t1) < TSC_CALIB_NS);
+	rates[i] = (get_counter() - c0) / (elapsed_ns(&t0, &t1) / 1e3);
+    }
+
+    /* insertion sort, for the median */
+    for (i = 1; i < TSC_CALIB_RUNS; i++)
+	for (j = i; j > 0 && rates[j - 1] > rates[j]; j--) {
+	    tmp = rates[j];
+	    rates[j] = rates[j - 1];
+	    rates[j - 1] = tmp;
+	}
+    if (verbose)
+	printf("Invariant TSC rate ~= %.1f MHz\n", rates[TSC_CALIB_RUNS / 2]);
+    return rates[TSC_CALIB_RUNS / 2];
+}
+
 #elif defined(__alpha)
 
 /****************************************************
@@ -161,6 +218,19 @@ double get_counter()
 }
 #endif
 
+#if !defined(__i386__) && !defined(__x86_64__)
+/* No TSC: fsecs falls back to CLOCK_MONOTONIC_RAW */
+int tsc_invariant(void)
+{
+    return 0;
+}
+
+double tsc_mhz(int verbose __attribute__((unused)))
+{
+    return 0.0;
+}
+#endif
+
 
 
 
@@ -180,6 +250,22 @@ double ovhd()
     return result;
 }
 
+/* Nanosecond counter from CLOCK_MONOTONIC_RAW */
+static struct timespec ns_start;
+
+void start_ns_counter(void)
+{
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ns_start);
+}
+
+double get_ns_counter(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    return (now.tv_sec - ns_start.tv_sec) * 1e9 + (now.tv_nsec - ns_start.tv_nsec);
+}
+
 /* $begin mhz */
 /* Get the clock rate from /proc */
 double mhz_full(int verbose, int sleeptime __attribute__((unused)))
@@ -1,5 +1,8 @@
 /* Routines for using cycle counter */
 
+/* Read the raw cycle counter */
+void access_counter(unsigned *hi, unsigned *lo);
+
 /* Start the counter */
 void start_counter();
 
@@ -15,6 +18,19 @@ double mhz(int verbose);
 /* Determine clock rate of processor, having more control over accuracy */
 double mhz_full(int verbose, int sleeptime);
 
+/* Return 1 if the cycle counter ticks at a constant rate in every
+   P-state and C-state (an invariant TSC), so it measures time */
+int tsc_invariant(void);
+
+/* Frequency of the invariant TSC in MHz, calibrated against
+   CLOCK_MONOTONIC_RAW instead of read from /proc/cpuinfo */
+double tsc_mhz(int verbose);
+
+/* Start and read a counter of nanoseconds from CLOCK_MONOTONIC_RAW,
+   which NTP does not slew */
+void start_ns_counter(void);
+double get_ns_counter(void);
+
 /** Special counters that compensate for timer interrupt overhead */
 
 void start_comp_counter();
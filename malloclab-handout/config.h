@@ -86,20 +86,39 @@
 #define UTIL_WEIGHT .63
 
 /*
- * Alignment requirement in bytes (either 4 or 8)
+ * Alignment requirement in bytes (either 4 or 8). libmm.so replaces
+ * the C library's malloc, so it gives glibc's 16.
  */
+#ifdef PRELOAD
+#define ALIGNMENT 16
+#else
 #define ALIGNMENT 8
+#endif
 
 /*
  * Maximum heap size in bytes
  */
+#ifdef PRELOAD
+/* libmm.so only reserves the address space; mm.c keeps 32-bit offsets */
+#define MAX_HEAP (1UL<<32)      /* 4 GB */
+#else
 #define MAX_HEAP (100*(1<<20))  /* 100 MB */
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
-#define USE_FCYC   1   /* cycle counter w/K-best scheme (x86 & Alpha only) */
-#define USE_ITIMER 0   /* interval timer (any Unix box) */
-#define USE_GETTOD 0   /* gettimeofday (any Unix box) */
+#define USE_FCYC    0  /* cycle counter w/K-best scheme (x86 & Alpha only) */
+#define USE_TSC     1  /* invariant TSC, calibrated, w/K-best (falls back to USE_MONORAW) */
+#define USE_MONORAW 0  /* clock_gettime(CLOCK_MONOTONIC_RAW) w/K-best (Linux) */
+#define USE_ITIMER  0  /* interval timer (any Unix box) */
+#define USE_GETTOD  0  /* gettimeofday (any Unix box) */
+
+/*
+ * Set to "1" to also count the cycles, instructions and cache misses
+ * of one more run of each timed trace with perf_event_open, and print
+ * them per request after the results
+ */
+#define USE_PERFCTR 0
 
 #endif /* __CONFIG_H */
@@ -5,7 +5,8 @@
  * May not be used, modified, or copied without permission.
  *
  * Uses the cycle timer routines in clock.c to estimate the
- * the time in CPU cycles for a function f.
+ * the time in CPU cycles for a function f, or in nanoseconds of
+ * CLOCK_MONOTONIC_RAW after set_fcyc_counter(FCYC_MONORAW).
  */
 #include <stdlib.h>
 #include <sys/times.h>
@@ -22,6 +23,7 @@
 #define CLEAR_CACHE 0        /* Clear cache before running test function */
 #define CACHE_BYTES (1<<19)  /* Max cache size in bytes */
 #define CACHE_BLOCK 32       /* Cache block size in bytes */
+#define COUNTER FCYC_CYCLES  /* Counter to read */
 
 static int kbest = K;
 static int maxsamples = MAXSAMPLES;
@@ -30,6 +32,7 @@ static int compensate = COMPENSATE;
 static int clear_cache = CLEAR_CACHE;
 static int cache_bytes = CACHE_BYTES;
 static int cache_block = CACHE_BLOCK;
+static int counter = COUNTER;
 
 static int *cache_buf = NULL;
 
@@ -130,7 +133,17 @@ double fcyc(test_funct f, void *argp)
 {
     double result;
     init_sampler();
-    if (compensate) {
+    if (counter == FCYC_MONORAW) {
+	do {
+	    double ns;
+	    if (clear_cache)
+		clear();
+	    start_ns_counter();
+	    f(argp);
+	    ns = get_ns_counter();
+	    add_sample(ns);
+	} while (!has_converged() && samplecount < maxsamples);
+    } else if (compensate) {
 	do {
 	    double cyc;
 	    if (clear_cache)
@@ -236,6 +249,16 @@ void set_fcyc_maxsamples(int maxsamples_arg)
     maxsamples = maxsamples_arg;
 }
 
+/* 
+ * set_fcyc_counter - Counter that fcyc reads, FCYC_CYCLES or
+ *     FCYC_MONORAW
+ *     Default = FCYC_CYCLES
+ */
+void set_fcyc_counter(int counter_arg)
+{
+    counter = counter_arg;
+}
+
 /* 
  * set_fcyc_epsilon - Tolerance required for K-best
  *     Default = 0.01
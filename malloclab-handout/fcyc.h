@@ -13,6 +13,10 @@ typedef void (*test_funct)(void *);
 /* Compute number of cycles used by test function f */
 double fcyc(test_funct f, void* argp);
 
+/* The counters that fcyc can read */
+#define FCYC_CYCLES  0       /* cycle counter, in cycles */
+#define FCYC_MONORAW 1       /* CLOCK_MONOTONIC_RAW, in nanoseconds */
+
 /*********************************************************
  * Set the various parameters used by measurement routines 
  *********************************************************/
@@ -57,6 +61,13 @@ void set_fcyc_k(int k);
  */
 void set_fcyc_maxsamples(int maxsamples_arg);
 
+/* 
+ * set_fcyc_counter - Counter that fcyc reads, FCYC_CYCLES or
+ *     FCYC_MONORAW. Compensation only applies to FCYC_CYCLES.
+ *     Default = FCYC_CYCLES
+ */
+void set_fcyc_counter(int counter);
+
 /* 
  * set_fcyc_epsilon - Tolerance required for K-best
  *     Default = 0.01
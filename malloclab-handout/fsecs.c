@@ -9,6 +9,10 @@
 #include "config.h"
 
 static double Mhz;  /* estimated CPU clock frequency */
+#if USE_TSC || USE_MONORAW
+static int use_ns;  /* fcyc counts nanoseconds, not cycles */
+#endif
+static perfctr_t last_ctr; /* events of the last fsecs call */
 
 extern int verbose; /* -v option in mdriver.c */
 
@@ -30,6 +34,23 @@ void init_fsecs(void)
     set_fcyc_epsilon(0.01);
     set_fcyc_k(3);
     Mhz = mhz(verbose > 0);
+#elif USE_TSC || USE_MONORAW
+    /* the tick compensation of USE_FCYC only corrects old kernels */
+    set_fcyc_maxsamples(20);
+    set_fcyc_clear_cache(1);
+    set_fcyc_compensate(0);
+    set_fcyc_epsilon(0.01);
+    set_fcyc_k(3);
+    if (USE_TSC && tsc_invariant()) {
+	if (verbose)
+	    printf("Measuring performance with the invariant TSC.\n");
+	Mhz = tsc_mhz(verbose > 0);
+    } else {
+	if (verbose)
+	    printf("Measuring performance with CLOCK_MONOTONIC_RAW.\n");
+	set_fcyc_counter(FCYC_MONORAW);
+	use_ns = 1;
+    }
 #elif USE_ITIMER
     if (verbose)
 	printf("Measuring performance with the interval timer.\n");
@@ -37,6 +58,11 @@ void init_fsecs(void)
     if (verbose)
 	printf("Measuring performance with gettimeofday().\n");
 #endif
+
+#if USE_PERFCTR
+    if (perfctr_init() == 0 && verbose)
+	printf("No hardware event counters, perf_event_open failed.\n");
+#endif
 }
 
 /*
@@ -44,14 +70,37 @@ void init_fsecs(void)
  */
 double fsecs(fsecs_test_funct f, void *argp) 
 {
-#if USE_FCYC
+    double secs = 0;
+
+#if USE_FCYC || USE_TSC || USE_MONORAW
     double cycles = fcyc(f, argp);
-    return cycles/(Mhz*1e6);
+#if USE_FCYC
+    secs = cycles/(Mhz*1e6);
+#else
+    secs = use_ns ? cycles/1e9 : cycles/(Mhz*1e6);
+#endif
 #elif USE_ITIMER
-    return ftimer_itimer(f, argp, 10);
+    secs = ftimer_itimer(f, argp, 10);
 #elif USE_GETTOD
-    return ftimer_gettod(f, argp, 10);
+    secs = ftimer_gettod(f, argp, 10);
 #endif 
+
+    /* count the events of one more run, outside of the timed ones */
+#if USE_PERFCTR
+    perfctr_init(); /* opens the counters again in a forked worker */
+    perfctr_start();
+    f(argp);
+    perfctr_stop(&last_ctr);
+#endif
+    return secs;
+}
+
+/*
+ * fsecs_perfctr - Return the events that the last fsecs call counted
+ */
+void fsecs_perfctr(perfctr_t *c)
+{
+    *c = last_ctr;
 }
 
 
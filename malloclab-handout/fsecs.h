@@ -1,4 +1,9 @@
+#include "perfctr.h"
+
 typedef void (*fsecs_test_funct)(void *);
 
 void init_fsecs(void);
 double fsecs(fsecs_test_funct f, void *argp);
+
+/* The events of the last fsecs call; all invalid unless USE_PERFCTR */
+void fsecs_perfctr(perfctr_t *c);
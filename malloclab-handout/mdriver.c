@@ -7,6 +7,7 @@
  * Copyright (c) 2004, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE            /* sched_setaffinity */
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
@@ -18,13 +19,23 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#endif
 
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
 #include "config.h"
 #include "driverlib.h"
+#include "trace.h"
+#include "perfctr.h"
 
 /**********************
  * Constants and macros
@@ -49,29 +60,31 @@
  * Remember that index (-1) is the null pointer.
  */
 
-/* Records the extent of each block's payload */
+/*
+ * Records the extent of each block's payload. The live payloads are
+ * disjoint, so they are kept in an AVL tree ordered by lo; a new
+ * payload overlaps some live one iff it overlaps the live payload
+ * with the largest lo <= its hi.
+ */
 typedef struct range_t {
 	char *lo;              /* low payload address */
 	char *hi;              /* high payload address */
-	struct range_t *next;  /* next list element */
+	struct range_t *left;  /* payloads below lo */
+	struct range_t *right; /* payloads above hi */
+	int height;            /* height of the subtree rooted here */
 	int index;             /* same index as free; for debugging */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-	enum { ALLOC, FREE, REALLOC } type; /* type of request */
-	int index;                        /* index for free() to use later */
-	size_t size;                      /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
 	char filename[MAXLINE];
-	int ignore_ranges;   /* don't check ranges (i.e. this is too big) */
+	int ignore_ranges;   /* too big to check every block's data under -D */
 	int num_ids;         /* number of alloc/realloc ids */
 	int num_ops;         /* number of distinct requests */
 	int weight;          /* weight for this trace (unused) */
 	traceop_t *ops;      /* array of requests */
+	void *map;           /* mapping of a binary trace file, or NULL... */
+	size_t map_len;      /* ... and its length; ops points into it */
 	char **blocks;       /* array of ptrs returned by malloc/realloc... */
 	size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 	int *block_rand_base;/* index into random_data, if debug is on */
@@ -100,10 +113,42 @@ typedef struct {
 
 	/* defined only for the student malloc package */
 	double util;     /* space utilization for this trace (always 0 for libc) */
+	double heapsize; /* peak heap size in bytes */
+	double resident; /* heap bytes still resident at the end of the trace */
+
+	perfctr_t ctr;   /* events of one timed run (USE_PERFCTR in config.h) */
 
 	/* Note: secs and util are only defined if valid is true */
 } stats_t;
 
+/*
+ * Latency histogram of one request type, in cycles. Like an HDR
+ * histogram, every power of two is split into LAT_SUB_BUCKETS linear
+ * buckets, so a percentile is off by at most 1/LAT_SUB_BUCKETS.
+ */
+#define LAT_SUB_BITS    5
+#define LAT_SUB_BUCKETS (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS     ((64 - LAT_SUB_BITS + 1) * LAT_SUB_BUCKETS)
+
+typedef struct {
+	unsigned long counts[LAT_BUCKETS];
+	unsigned long total;     /* number of requests */
+	unsigned long long max;  /* exact maximum */
+} lat_hist_t;
+
+#ifdef THREAD_SAFE
+/*
+ * Holds the params of one replay thread in the multi-threaded mode.
+ * Every thread replays the whole trace with its own blocks array.
+ */
+typedef struct {
+	const trace_t *trace;
+	pthread_barrier_t *start;
+	char **blocks;       /* this thread's ptrs returned by malloc/realloc */
+	int failed;          /* set if malloc/realloc returned NULL */
+} mt_thread_t;
+#endif
+
 
 /********************
  * For debugging.  If debug-mode is on, then we have each block start
@@ -132,6 +177,38 @@ int onetime_flag = 0;
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+/* print the allocator statistics after each trace (-S) */
+static int print_stats = 0;
+
+/* print the latency percentiles of each request type after each trace (-L) */
+static int print_latency = 0;
+
+/* write a fragmentation timeline every frag_interval requests (-F) */
+static int frag_interval = 0;
+
+/*
+ * replay each trace once more touching the payloads (-P): touch_mode
+ * sets what is written at malloc/realloc and read back at free, and
+ * after every request the first byte of each of the touch_hot most
+ * recently allocated blocks is read again
+ */
+enum { TOUCH_NONE, TOUCH_HEAD, TOUCH_LINES, TOUCH_ALL };
+static const char *touch_names[] = { "none", "head", "lines", "all" };
+#define TOUCH_LINE 64   /* bytes between the touches of TOUCH_LINES */
+static int touch_mode = TOUCH_NONE;
+static int touch_hot = 0;
+static volatile unsigned long touch_sink; /* keeps the reads */
+
+/* number of worker processes that evaluate the traces (-j) */
+static int num_jobs = 1;
+
+#ifdef THREAD_SAFE
+/* replay the traces with 1, 2, 4, ... up to max_threads threads (-T) */
+static int max_threads = 0;
+/* number of memlib arenas for the replay (-a); 0 means one per thread */
+static int num_arenas = 0;
+#endif
+
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
@@ -148,11 +225,16 @@ char autoresult[SUBMITR_MAXBUF]; /* autoresult string */
  * Function prototypes
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate the range tree */
 static int add_range(range_t **ranges, char *lo, int size,
 		const trace_t *trace, int opnum, int index);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static range_t *range_insert(range_t *root, range_t *r);
+static range_t *range_delete(range_t *root, char *lo, range_t **removed);
+static range_t *range_delete_min(range_t *root, range_t **min);
+static range_t *range_balance(range_t *r);
+static void check_ranges(const trace_t *trace, int opnum, const range_t *r);
 
 /* These functions implement the debugging code */
 static void init_random_data(void);
@@ -162,6 +244,7 @@ static void randomize_block(trace_t *trace, int index);
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
 		const char *filename);
+static void map_trace(trace_t *trace, FILE *tracefile);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
@@ -172,11 +255,37 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, lat_hist_t *hists);
+static void eval_mm_touch(trace_t *trace, unsigned long long *cycles,
+		perfctr_t *ctr);
+static FILE *open_timeline(const char *filename);
+static void write_timeline(FILE *fp, int opnum, int live_bytes);
+
+#ifdef THREAD_SAFE
+/* Routines for measuring how the mm malloc package scales with threads */
+static void run_mt_tests(int num_tracefiles, const char *tracedir,
+		char **tracefiles);
+static void *eval_mm_mt_thread(void *ptr);
+#endif
+
+/* Routines for evaluating the traces in parallel worker processes */
+static void run_tests_parallel(int num_tracefiles, const char *tracedir,
+		char **tracefiles, stats_t *mm_stats, int jobs);
+static void pin_to_cpu(int worker);
+static int read_full(int fd, void *buf, size_t len);
+static void write_full(int fd, const void *buf, size_t len);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+#if USE_PERFCTR
+static void print_perfctr(int n, stats_t *stats);
+#endif
+static void print_mm_stats(const char *filename);
+static void print_latency_hists(const char *filename, lat_hist_t *hists);
+static void print_touch(const trace_t *trace, unsigned long long cycles,
+		const perfctr_t *ctr);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
 	__attribute__((format(printf, 3,4)));
@@ -225,17 +334,184 @@ static void run_tests(int num_tracefiles, const char *tracedir,
 		if (mm_stats[i].valid) {
 			if (verbose > 1)
 				printf("efficiency, ");
-			mm_stats[i].util = eval_mm_util(trace, i);
+			mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i]);
+			if (print_stats)
+				print_mm_stats(trace->filename);
+			if (print_latency) {
+				lat_hist_t hists[3];
+
+				eval_mm_latency(trace, NULL);  /* warm up */
+				eval_mm_latency(trace, hists);
+				print_latency_hists(trace->filename, hists);
+			}
+			if (touch_mode != TOUCH_NONE) {
+				unsigned long long cycles;
+				perfctr_t ctr;
+
+				eval_mm_touch(trace, NULL, NULL);  /* warm up */
+				eval_mm_touch(trace, &cycles, &ctr);
+				print_touch(trace, cycles, &ctr);
+			}
 			speed_params->trace = trace;
 			speed_params->ranges = ranges;
 			if (verbose > 1)
 				printf("and performance.\n");
 			mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+			fsecs_perfctr(&mm_stats[i].ctr);
 		}
 		free_trace(trace);
 	}
 }
 
+/*
+ * run_tests_parallel - Evaluate the traces in jobs worker processes.
+ *     Worker w takes traces w, w + jobs, w + 2*jobs, ... and runs them
+ *     with run_tests in its own copy of the memlib heap, pinned to its
+ *     own CPU so that the timings do not disturb each other. After each
+ *     trace the worker sends the stats_t record and its error count so
+ *     far back over a pipe; if a worker dies, its remaining traces are
+ *     marked invalid.
+ */
+static void run_tests_parallel(int num_tracefiles, const char *tracedir,
+		char **tracefiles, stats_t *mm_stats, int jobs)
+{
+	int w, i, status;
+	int (*fds)[2];
+	pid_t *pids;
+	cpu_set_t allowed;
+
+	if (jobs > num_tracefiles)
+		jobs = num_tracefiles;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0 &&
+			jobs > CPU_COUNT(&allowed))
+		fprintf(stderr, "Warning: %d workers share %d CPUs, "
+				"the throughput numbers will be noisy\n",
+				jobs, CPU_COUNT(&allowed));
+
+	if ((fds = malloc(jobs * sizeof(*fds))) == NULL ||
+			(pids = malloc(jobs * sizeof(*pids))) == NULL)
+		unix_error("malloc failed in run_tests_parallel");
+
+	for (w = 0; w < jobs; w++) {
+		if (pipe(fds[w]) < 0)
+			unix_error("pipe failed in run_tests_parallel");
+		if ((pids[w] = fork()) < 0)
+			unix_error("fork failed in run_tests_parallel");
+
+		if (pids[w] == 0) {
+			/* Worker: run this worker's share of the traces one by one */
+			range_t *ranges = NULL;
+			speed_t speed_params;
+			stats_t stats;
+
+			close(fds[w][0]);
+			pin_to_cpu(w);
+			if (set_timeout)
+				init_timeout(set_timeout); /* alarms are not inherited */
+
+			for (i = w; i < num_tracefiles; i += jobs) {
+				memset(&stats, 0, sizeof(stats));
+				run_tests(1, tracedir, &tracefiles[i], &stats, ranges,
+						&speed_params);
+				write_full(fds[w][1], &stats, sizeof(stats));
+				write_full(fds[w][1], &errors, sizeof(errors));
+			}
+			_exit(0);
+		}
+		close(fds[w][1]);
+	}
+
+	/* Merge the results back in trace order */
+	for (w = 0; w < jobs; w++) {
+		int worker_errors = 0;
+		int ok = 1;
+
+		for (i = w; i < num_tracefiles; i += jobs) {
+			if (ok)
+				ok = read_full(fds[w][0], &mm_stats[i], sizeof(stats_t)) &&
+					read_full(fds[w][0], &worker_errors, sizeof(worker_errors));
+			if (!ok) {
+				/* The worker crashed before this trace was done */
+				strcpy(mm_stats[i].filename, tracedir);
+				strcat(mm_stats[i].filename, tracefiles[i]);
+				mm_stats[i].valid = 0;
+			}
+		}
+		close(fds[w][0]);
+		errors += worker_errors;
+
+		waitpid(pids[w], &status, 0);
+		if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "Worker %d (traces %d, %d, ...) failed\n",
+					w, w, w + jobs);
+			errors++;
+		}
+	}
+
+	free(fds);
+	free(pids);
+}
+
+/*
+ * pin_to_cpu - Bind the calling worker to the worker-th CPU it is
+ *     allowed to run on (round robin if there are more workers)
+ */
+static void pin_to_cpu(int worker)
+{
+	cpu_set_t allowed, one;
+	int cpu, k;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+		return;
+
+	k = worker % CPU_COUNT(&allowed);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed) && k-- == 0)
+			break;
+	}
+	CPU_ZERO(&one);
+	CPU_SET(cpu, &one);
+	if (sched_setaffinity(0, sizeof(one), &one) < 0 && verbose > 1)
+		fprintf(stderr, "Worker %d could not be pinned to CPU %d\n", worker, cpu);
+}
+
+/*
+ * read_full - Read exactly len bytes from a pipe; returns 0 at EOF
+ */
+static int read_full(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = read(fd, p, len)) < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/*
+ * write_full - Write all len bytes to a pipe
+ */
+static void write_full(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			unix_error("write failed in worker");
+		p += n;
+		len -= n;
+	}
+}
+
 /**************
  * Main routine
  **************/
@@ -258,6 +534,7 @@ int main(int argc, char **argv)
 	double secs, ops, util, avg_mm_util, avg_mm_throughput = 0, p1, p2, perfindex;
 	double weight = 0;
 	int numcorrect;
+	char *colon;
 
 
 	setbuf(stdout, 0);
@@ -266,7 +543,7 @@ int main(int argc, char **argv)
 	/*
 	 * Read and interpret the command line arguments
 	 */
-	while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlD")) != EOF) {
+	while ((c = getopt(argc, argv, "d:f:c:s:t:v:T:a:j:F:P:hVAlDSL")) != EOF) {
 		switch (c) {
 
 			case 'A': /* Hidden Autolab driver argument */
@@ -324,6 +601,54 @@ int main(int argc, char **argv)
 				set_timeout = atoi(optarg);
 				break;
 
+			case 'S': /* Print allocator statistics */
+				print_stats = 1;
+				break;
+
+			case 'L': /* Print latency percentiles */
+				print_latency = 1;
+				break;
+
+			case 'F': /* Sample the fragmentation timeline every n requests */
+				frag_interval = atoi(optarg);
+				if (frag_interval < 1)
+					app_error("-F must be at least 1");
+				break;
+
+			case 'P': /* Replay touching the payloads: head|lines|all[:hot] */
+				touch_hot = 0;
+				if ((colon = strchr(optarg, ':')) != NULL) {
+					*colon = '\0';
+					if ((touch_hot = atoi(colon + 1)) < 1)
+						app_error("-P hot block count must be at least 1");
+				}
+				for (touch_mode = TOUCH_HEAD; touch_mode <= TOUCH_ALL; touch_mode++)
+					if (strcmp(optarg, touch_names[touch_mode]) == 0)
+						break;
+				if (touch_mode > TOUCH_ALL)
+					app_error("-P must be head, lines or all, optionally followed by :<n>");
+				break;
+
+			case 'j': /* Evaluate the traces in this many worker processes */
+				num_jobs = atoi(optarg);
+				if (num_jobs < 1)
+					app_error("-j must be at least 1");
+				break;
+
+#ifdef THREAD_SAFE
+			case 'T': /* Replay the traces concurrently with up to T threads */
+				max_threads = atoi(optarg);
+				if (max_threads < 1)
+					app_error("-T must be at least 1");
+				break;
+
+			case 'a': /* Number of heap arenas for -T */
+				num_arenas = atoi(optarg);
+				if (num_arenas < 0 || num_arenas > MEM_ARENA_MAX)
+					app_error("-a must be between 0 and %d", MEM_ARENA_MAX);
+				break;
+#endif
+
 			case 'h': /* Print this message */
 				usage();
 				exit(0);
@@ -377,6 +702,7 @@ int main(int argc, char **argv)
 				if (verbose > 1)
 					printf("and performance.\n");
 				libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+				fsecs_perfctr(&libc_stats[i].ctr);
 			}
 			free_trace(trace);
 		}
@@ -402,9 +728,17 @@ int main(int argc, char **argv)
 	/* Initialize the simulated memory system in memlib.c */
 	mem_init();
 
-	run_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
-			ranges, &speed_params);
+	if (num_jobs > 1 && num_tracefiles > 1)
+		run_tests_parallel(num_tracefiles, tracedir, tracefiles, mm_stats,
+				num_jobs);
+	else
+		run_tests(num_tracefiles, tracedir, tracefiles, mm_stats,
+				ranges, &speed_params);
 
+#ifdef THREAD_SAFE
+	if (max_threads > 0 && !onetime_flag)
+		run_mt_tests(num_tracefiles, tracedir, tracefiles);
+#endif
 
 	/* Display the mm results in a compact table */
 	if (verbose) {
@@ -511,7 +845,7 @@ static int add_range(range_t **ranges, char *lo, int size,
 		const trace_t *trace, int opnum, int index)
 {
 	char *hi = lo + size - 1;
-	range_t *p;
+	range_t *p, *q;
 
 	assert(size > 0);
 
@@ -522,42 +856,47 @@ static int add_range(range_t **ranges, char *lo, int size,
 		return 0;
 	}
 
-	/* The payload must lie within the extent of the heap */
-	if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-			(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+	/* The payload must lie within the extent of the heap, or within
+	   one of the mappings the allocator made with mem_map */
+	if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+			(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+			!mem_is_mapped(lo, hi)) {
 		malloc_error(trace, opnum,
 				"Payload (%p:%p) lies outside heap (%p:%p)",
 				lo, hi, mem_heap_lo(), mem_heap_hi());
 		return 0;
 	}
 
-	/* If we can't afford the linear-time loop, we check less thoroughly and
-	   just assume the overlap will be caught by writing random bits. */
-	if(trace->ignore_ranges || debug_mode == DBG_NONE) return 1;
+	/* With debugging off, overlaps are not checked at all */
+	if (debug_mode == DBG_NONE) return 1;
 
-
-	/* The payload must not overlap any other payloads */
-	for (p = *ranges;  p != NULL;  p = p->next) {
-		if ((lo >= p->lo && lo <= p-> hi) ||
-				(hi >= p->lo && hi <= p->hi)) {
-			malloc_error(trace, opnum,
-					"Payload (%p:%p) overlaps another payload (%p:%p)\n",
-					lo, hi, p->lo, p->hi);
-			return 0;
+	/* The payload must not overlap any other payloads: find the live
+	   payload with the largest lo <= hi, the only one that can */
+	for (q = NULL, p = *ranges;  p != NULL; ) {
+		if (p->lo <= hi) {
+			q = p;
+			p = p->right;
+		} else {
+			p = p->left;
 		}
 	}
+	if (q != NULL && q->hi >= lo) {
+		malloc_error(trace, opnum,
+				"Payload (%p:%p) overlaps another payload (%p:%p)\n",
+				lo, hi, q->lo, q->hi);
+		return 0;
+	}
 
 	/*
 	 * Everything looks OK, so remember the extent of this block
-	 * by creating a range struct and adding it the range list.
+	 * by creating a range struct and adding it the range tree.
 	 */
 	if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 		unix_error("malloc error in add_range");
-	p->next = *ranges;
 	p->lo = lo;
 	p->hi = hi;
 	p->index = index;
-	*ranges = p;
+	*ranges = range_insert(*ranges, p);
 
 	return 1;
 }
@@ -567,19 +906,10 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-	range_t *p;
-	range_t **prevpp = ranges;
-	int size;
-
-	for (p = *ranges;  p != NULL; p = p->next) {
-		if (p->lo == lo) {
-			*prevpp = p->next;
-			size = p->hi - p->lo + 1;
-			free(p);
-			break;
-		}
-		prevpp = &(p->next);
-	}
+	range_t *p = NULL;
+
+	*ranges = range_delete(*ranges, lo, &p);
+	free(p);
 }
 
 /*
@@ -587,16 +917,114 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-	range_t *p;
-	range_t *pnext;
+	range_t *p = *ranges;
 
-	for (p = *ranges;  p != NULL;  p = pnext) {
-		pnext = p->next;
-		free(p);
-	}
+	if (p == NULL)
+		return;
+	clear_ranges(&p->left);
+	clear_ranges(&p->right);
+	free(p);
 	*ranges = NULL;
 }
 
+#define RANGE_HEIGHT(r) ((r) ? (r)->height : 0)
+
+/*
+ * range_balance - Recompute the height of r and rotate it back into
+ *     AVL shape if its subtrees differ by two; returns the new root
+ */
+static range_t *range_balance(range_t *r)
+{
+	int lh = RANGE_HEIGHT(r->left);
+	int rh = RANGE_HEIGHT(r->right);
+	range_t *c;
+
+	if (lh > rh + 1) {
+		c = r->left;
+		if (RANGE_HEIGHT(c->left) < RANGE_HEIGHT(c->right)) {
+			r->left = c->right;
+			c->right = r->left->left;
+			r->left->left = range_balance(c);
+			c = r->left;
+		}
+		r->left = c->right;
+		c->right = range_balance(r);
+		return range_balance(c);
+	}
+	if (rh > lh + 1) {
+		c = r->right;
+		if (RANGE_HEIGHT(c->right) < RANGE_HEIGHT(c->left)) {
+			r->right = c->left;
+			c->left = r->right->right;
+			r->right->right = range_balance(c);
+			c = r->right;
+		}
+		r->right = c->left;
+		c->left = range_balance(r);
+		return range_balance(c);
+	}
+	r->height = (lh > rh ? lh : rh) + 1;
+	return r;
+}
+
+/*
+ * range_insert - Insert r into the tree rooted at root; returns the new root
+ */
+static range_t *range_insert(range_t *root, range_t *r)
+{
+	if (root == NULL) {
+		r->left = r->right = NULL;
+		r->height = 1;
+		return r;
+	}
+	if (r->lo < root->lo)
+		root->left = range_insert(root->left, r);
+	else
+		root->right = range_insert(root->right, r);
+	return range_balance(root);
+}
+
+/*
+ * range_delete_min - Unlink the smallest range of the tree rooted at
+ *     root and return it in *min; returns the new root
+ */
+static range_t *range_delete_min(range_t *root, range_t **min)
+{
+	if (root->left == NULL) {
+		*min = root;
+		return root->right;
+	}
+	root->left = range_delete_min(root->left, min);
+	return range_balance(root);
+}
+
+/*
+ * range_delete - Unlink the range that starts at lo from the tree rooted
+ *     at root and return it in *removed; returns the new root
+ */
+static range_t *range_delete(range_t *root, char *lo, range_t **removed)
+{
+	range_t *min;
+
+	if (root == NULL)
+		return NULL;
+	if (lo < root->lo) {
+		root->left = range_delete(root->left, lo, removed);
+	} else if (lo > root->lo) {
+		root->right = range_delete(root->right, lo, removed);
+	} else {
+		*removed = root;
+		if (root->left == NULL || root->right == NULL)
+			return root->left ? root->left : root->right;
+		/* Replace root by the smallest range of its right subtree */
+		root->right = range_delete_min(root->right, &min);
+		min->left = root->left;
+		min->right = root->right;
+		root = min;
+	}
+	return range_balance(root);
+}
+
 /**********************************************
  * The following routines handle the random data used for
  * checking memory access.
@@ -664,7 +1092,8 @@ static void check_index(const trace_t *trace, int opnum, int index) {
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file and store it in memory; a binary
+ *     trace written by rep2bin is mapped instead of parsed
  */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
 		const char *filename)
@@ -689,10 +1118,19 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 	if ((tracefile = fopen(trace->filename, "r")) == NULL) {
 		unix_error("Could not open %s in read_trace", trace->filename);
 	}
-	fscanf(tracefile, "%d", &trace->weight);
-	fscanf(tracefile, "%d", &trace->num_ids);
-	fscanf(tracefile, "%d", &trace->num_ops);
-	fscanf(tracefile, "%d", &trace->ignore_ranges);
+	/* A binary trace (see trace.h) is mapped instead of parsed */
+	trace->map = NULL;
+	trace->map_len = 0;
+	if (fread(type, 1, TRACE_MAGIC_LEN, tracefile) == TRACE_MAGIC_LEN &&
+			memcmp(type, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0) {
+		map_trace(trace, tracefile);
+	} else {
+		rewind(tracefile);
+		fscanf(tracefile, "%d", &trace->weight);
+		fscanf(tracefile, "%d", &trace->num_ids);
+		fscanf(tracefile, "%d", &trace->num_ops);
+		fscanf(tracefile, "%d", &trace->ignore_ranges);
+	}
 
 	if(trace->weight != 0 && trace->weight != 1) {
 		app_error("%s: weight can only be zero or one", trace->filename);
@@ -702,7 +1140,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 	}
 
 	/* We'll store each request line in the trace in this array */
-	if ((trace->ops =
+	if (trace->map == NULL && (trace->ops =
 				(traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
 		unix_error("malloc 2 failed in read_trace");
 
@@ -722,6 +1160,22 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 		unix_error("malloc 5 failed in read_trace");
 
 
+	/* The records of a binary trace only need their ids checked */
+	if (trace->map != NULL) {
+		fclose(tracefile);
+		for (op_index = 0; op_index < trace->num_ops; op_index++) {
+			index = trace->ops[op_index].index;
+			if (index >= trace->num_ids ||
+					(index < 0 && trace->ops[op_index].type != FREE))
+				app_error("%s: bad id %d in request %d", trace->filename,
+						index, op_index);
+		}
+		strcpy(stats->filename, trace->filename);
+		stats->weight = trace->weight;
+		stats->ops = trace->num_ops;
+		return trace;
+	}
+
 	/* read every request line in the trace file */
 	index = 0;
 	op_index = 0;
@@ -765,6 +1219,42 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 	return trace;
 }
 
+/*
+ * map_trace - Map the binary trace file that tracefile has open and
+ *     fill in the header fields of trace; ops points into the mapping
+ */
+static void map_trace(trace_t *trace, FILE *tracefile)
+{
+	struct stat st;
+	trace_hdr_t *hdr;
+
+	if (fstat(fileno(tracefile), &st) < 0)
+		unix_error("fstat failed in map_trace for %s", trace->filename);
+	if ((size_t)st.st_size < sizeof(trace_hdr_t))
+		app_error("%s: truncated binary trace", trace->filename);
+
+	trace->map_len = st.st_size;
+	trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE,
+			fileno(tracefile), 0);
+	if (trace->map == MAP_FAILED)
+		unix_error("mmap failed in map_trace for %s", trace->filename);
+
+	hdr = (trace_hdr_t *)trace->map;
+	if (hdr->op_size != sizeof(traceop_t))
+		app_error("%s: binary trace was written with %d-byte records, "
+				"run rep2bin again on this machine", trace->filename, hdr->op_size);
+	if (hdr->num_ops < 0 || trace->map_len !=
+			sizeof(trace_hdr_t) + (size_t)hdr->num_ops * sizeof(traceop_t))
+		app_error("%s: binary trace length does not match its header",
+				trace->filename);
+
+	trace->weight = hdr->weight;
+	trace->num_ids = hdr->num_ids;
+	trace->num_ops = hdr->num_ops;
+	trace->ignore_ranges = hdr->ignore_ranges;
+	trace->ops = (traceop_t *)(hdr + 1);
+}
+
 /*
  * reinit_trace - get the trace ready for another run.
  */
@@ -781,7 +1271,10 @@ static void reinit_trace(trace_t *trace)
  */
 static void free_trace(trace_t *trace)
 {
-	free(trace->ops);         /* free the three arrays... */
+	if (trace->map != NULL)   /* unmap a binary trace, or... */
+		munmap(trace->map, trace->map_len);
+	else
+		free(trace->ops);     /* free the three arrays... */
 	free(trace->blocks);
 	free(trace->block_sizes);
 	free(trace->block_rand_base);
@@ -793,6 +1286,18 @@ static void free_trace(trace_t *trace)
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * check_ranges - Check the data of every block in the range tree r
+ */
+static void check_ranges(const trace_t *trace, int opnum, const range_t *r)
+{
+	if (r == NULL)
+		return;
+	check_ranges(trace, opnum, r->left);
+	check_index(trace, opnum, r->index);
+	check_ranges(trace, opnum, r->right);
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
@@ -822,17 +1327,14 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 		size = trace->ops[i].size;
 
 		if(debug_mode == DBG_EXPENSIVE) {
-			range_t *r;
-			
 			/* Let the students check their own heap */
 			mm_checkheap(verbose);
 
-			/* Now check that all our allocated blocks have the right data */
-			r = *ranges;
-			while(r) {
-				check_index(trace, i, r->index);
-				r = r->next;
-			}
+			/* Now check that all our allocated blocks have the right
+			   data, unless the trace is too big for an O(live) walk
+			   per request; overlaps are still checked by add_range */
+			if (!trace->ignore_ranges)
+				check_ranges(trace, i, *ranges);
 		}
 
 		switch (trace->ops[i].type) {
@@ -929,14 +1431,15 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   peak size of the heap in bytes while running the student's malloc
+ *   package on the trace. mem_sbrk() lets the students decrement the
+ *   brk pointer, so the peak is tracked by memlib rather than taken
+ *   from the final brk. The peak heap size and the heap bytes still
+ *   resident at the end are also stored in stats.
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats)
 {
 	int i;
 	int index;
@@ -945,13 +1448,18 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 	int total_size = 0;
 	char *p;
 	char *newp, *oldp;
+	FILE *timeline = NULL;
 
 	reinit_trace(trace);
 
-	/* initialize the heap and the mm malloc package */
+	/* initialize the heap and the mm malloc package, dropping the pages
+	   left resident by earlier traces so that only this one is counted */
 	mem_reset_brk();
+	mem_release(mem_heap_lo(), MAX_HEAP);
 	if (mm_init() < 0)
 		app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
+	if (frag_interval > 0)
+		timeline = open_timeline(trace->filename);
 
 	for (i = 0;  i < trace->num_ops;  i++) {
 		switch (trace->ops[i].type) {
@@ -1013,14 +1521,82 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 		/* update the high-water mark */
 		max_total_size = (total_size > max_total_size) ?
 			total_size : max_total_size;
+
+		if (timeline && ((i + 1) % frag_interval == 0 ||
+					i == trace->num_ops - 1))
+			write_timeline(timeline, i + 1, total_size);
 	}
 
+	if (timeline)
+		fclose(timeline);
 	printf(".");
 
-	return ((double)max_total_size / (double)mem_heapsize());
+	stats->heapsize = mem_heap_peak();
+	stats->resident = mem_resident();
+	return ((double)max_total_size / (double)mem_heap_peak());
 }
 
 
+/*
+ * open_timeline - Create the CSV file that eval_mm_util writes the
+ *     fragmentation timeline of a trace to: the trace's base name
+ *     with its extension replaced by .frag.csv, in the current
+ *     directory. The first line names the columns.
+ */
+static FILE *open_timeline(const char *filename)
+{
+	char path[MAXLINE];
+	const char *base;
+	char *dot;
+	mm_stats_t st;
+	FILE *fp;
+	int i;
+
+	base = strrchr(filename, '/');
+	base = base ? base + 1 : filename;
+	snprintf(path, sizeof(path), "%.*s", (int)sizeof(path) - 16, base);
+	if ((dot = strrchr(path, '.')) != NULL)
+		*dot = '\0';
+	strcat(path, ".frag.csv");
+
+	if ((fp = fopen(path, "w")) == NULL)
+		unix_error("Could not open %s for the fragmentation timeline", path);
+	if (verbose > 1)
+		printf("writing the fragmentation timeline to %s, ", path);
+
+	mm_stats(&st);
+	fprintf(fp, "op,live_bytes,heap_bytes,in_use_bytes,free_bytes,largest_free");
+	for (i = 0; i < st.class_num && i < MM_STATS_CLASS_MAX; i++)
+		fprintf(fp, ",class%d_free_bytes", i);
+	fputc('\n', fp);
+	return fp;
+}
+
+/*
+ * write_timeline - Append one sample of the fragmentation timeline
+ *     after request opnum: the live payload bytes of the trace, the
+ *     heap size that utilization is measured against, and the free
+ *     space of the allocator as reported by mm_stats
+ */
+static void write_timeline(FILE *fp, int opnum, int live_bytes)
+{
+	mm_stats_t st;
+	size_t free_bytes = 0;
+	int i, n;
+
+	mm_stats(&st);
+	n = st.class_num < MM_STATS_CLASS_MAX ? st.class_num : MM_STATS_CLASS_MAX;
+	for (i = 0; i < n; i++)
+		free_bytes += st.class_free_bytes[i];
+
+	fprintf(fp, "%d,%d,%lu,%lu,%lu,%lu", opnum, live_bytes,
+			(unsigned long)mem_heapsize(), (unsigned long)st.in_use_bytes,
+			(unsigned long)free_bytes, (unsigned long)st.largest_free);
+	for (i = 0; i < n; i++)
+		fprintf(fp, ",%lu", (unsigned long)st.class_free_bytes[i]);
+	fputc('\n', fp);
+}
+
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
  *    to measure the running time of the mm malloc package.
@@ -1073,6 +1649,395 @@ static void eval_mm_speed(void *ptr)
 		}
 }
 
+#ifdef THREAD_SAFE
+/*
+ * run_mt_tests - Replay each trace concurrently with 1, 2, 4, ...
+ *    max_threads threads, all sharing one heap split into num_arenas
+ *    arenas (one per thread by default), and print the wall-clock
+ *    throughput for each thread count. The traces are only timed here;
+ *    correctness and utilization come from the single-threaded run.
+ */
+static void run_mt_tests(int num_tracefiles, const char *tracedir,
+		char **tracefiles)
+{
+	int i, t, nthreads;
+	stats_t stats;
+	pthread_t *tids;
+	mt_thread_t *args;
+	pthread_barrier_t start;
+	struct timespec begin, end;
+
+	if ((tids = calloc(max_threads, sizeof(pthread_t))) == NULL)
+		unix_error("tids calloc in run_mt_tests failed");
+	if ((args = calloc(max_threads, sizeof(mt_thread_t))) == NULL)
+		unix_error("args calloc in run_mt_tests failed");
+
+	printf("\nMulti-threaded replay of mm malloc:\n");
+	printf("%8s%8s%10s%10s%10s  %s\n",
+			"threads", "arenas", "ops", "secs", "Kops", "trace");
+	for (i = 0; i < num_tracefiles; i++) {
+		trace_t *trace = read_trace(&stats, tracedir, tracefiles[i]);
+
+		for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+			int failed = 0;
+			int narenas = num_arenas ? num_arenas :
+				(nthreads < MEM_ARENA_MAX ? nthreads : MEM_ARENA_MAX);
+			double secs;
+
+			/* Split and reset the heap and initialize the mm package */
+			mem_arena_setup(narenas);
+			if (mm_init() < 0)
+				app_error("mm_init failed in run_mt_tests");
+
+			if (pthread_barrier_init(&start, NULL, nthreads + 1) != 0)
+				app_error("pthread_barrier_init failed in run_mt_tests");
+			for (t = 0; t < nthreads; t++) {
+				args[t].trace = trace;
+				args[t].start = &start;
+				args[t].failed = 0;
+				if ((args[t].blocks = calloc(trace->num_ids, sizeof(char *))) == NULL)
+					unix_error("blocks calloc in run_mt_tests failed");
+				if (pthread_create(&tids[t], NULL, eval_mm_mt_thread, &args[t]) != 0)
+					app_error("pthread_create failed in run_mt_tests");
+			}
+
+			/* Time from the moment every thread is ready until all of them exit */
+			clock_gettime(CLOCK_MONOTONIC, &begin);
+			pthread_barrier_wait(&start);
+			for (t = 0; t < nthreads; t++) {
+				pthread_join(tids[t], NULL);
+				failed |= args[t].failed;
+				free(args[t].blocks);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			pthread_barrier_destroy(&start);
+
+			/* With -D, check the heap the threads left behind */
+			if (debug_mode == DBG_EXPENSIVE)
+				mm_checkheap(verbose);
+
+			secs = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+			if (failed) {
+				printf("%8d%8d%10s%10s%10s  %s (out of memory)\n",
+						nthreads, narenas, "-", "-", "-", trace->filename);
+			} else {
+				printf("%8d%8d%10.0f%10.6f%10.0f  %s\n",
+						nthreads,
+						narenas,
+						stats.ops * nthreads,
+						secs,
+						(stats.ops * nthreads / 1e3) / secs,
+						trace->filename);
+			}
+		}
+		free_trace(trace);
+	}
+
+	mem_arena_setup(1);
+	free(tids);
+	free(args);
+}
+
+/*
+ * eval_mm_mt_thread - One replay thread of run_mt_tests. Stops at the
+ *    first failed request and flags it instead of exiting the driver.
+ */
+static void *eval_mm_mt_thread(void *ptr)
+{
+	int i, index;
+	char *p;
+	mt_thread_t *args = (mt_thread_t *)ptr;
+	const trace_t *trace = args->trace;
+	char **blocks = args->blocks;
+
+	pthread_barrier_wait(args->start);
+
+	for (i = 0;  i < trace->num_ops;  i++) {
+		index = trace->ops[i].index;
+		switch (trace->ops[i].type) {
+
+			case ALLOC: /* mm_malloc */
+				if ((p = mm_malloc(trace->ops[i].size)) == NULL) {
+					args->failed = 1;
+					return NULL;
+				}
+				blocks[index] = p;
+				break;
+
+			case REALLOC: /* mm_realloc */
+				if ((p = mm_realloc(blocks[index], trace->ops[i].size)) == NULL
+						&& trace->ops[i].size != 0) {
+					args->failed = 1;
+					return NULL;
+				}
+				blocks[index] = p;
+				break;
+
+			case FREE: /* mm_free */
+				mm_free(index < 0 ? NULL : blocks[index]);
+				break;
+
+			default:
+				app_error("Nonexistent request type in eval_mm_mt_thread");
+		}
+	}
+
+	return NULL;
+}
+#endif /* THREAD_SAFE */
+
+/*
+ * read_cycles - The cycle counter as one 64-bit number
+ */
+static inline unsigned long long read_cycles(void)
+{
+	unsigned hi, lo;
+
+	access_counter(&hi, &lo);
+	return ((unsigned long long)hi << 32) | lo;
+}
+
+/*
+ * lat_bucket - Histogram bucket of a latency of v cycles: values below
+ *     LAT_SUB_BUCKETS have a bucket each, larger ones keep their top
+ *     LAT_SUB_BITS + 1 bits
+ */
+static int lat_bucket(unsigned long long v)
+{
+	int shift;
+
+	if (v < LAT_SUB_BUCKETS)
+		return v;
+	shift = 63 - __builtin_clzll(v) - LAT_SUB_BITS;
+	return (shift + 1) * LAT_SUB_BUCKETS + (int)((v >> shift) - LAT_SUB_BUCKETS);
+}
+
+/*
+ * lat_bucket_max - Largest latency that falls into bucket b
+ */
+static unsigned long long lat_bucket_max(int b)
+{
+	int shift = b / LAT_SUB_BUCKETS - 1;
+
+	if (shift < 0)
+		return b;
+	return (((unsigned long long)(b % LAT_SUB_BUCKETS + LAT_SUB_BUCKETS + 1))
+			<< shift) - 1;
+}
+
+/*
+ * lat_percentile - Latency below which a fraction q of the requests in
+ *     h fall, rounded up to the end of its bucket
+ */
+static unsigned long long lat_percentile(const lat_hist_t *h, double q)
+{
+	unsigned long rank = (unsigned long)(q * h->total + 0.5);
+	unsigned long seen = 0;
+	int b;
+
+	if (rank == 0)
+		rank = 1;
+	for (b = 0; b < LAT_BUCKETS; b++) {
+		seen += h->counts[b];
+		if (seen >= rank)
+			return lat_bucket_max(b) < h->max ? lat_bucket_max(b) : h->max;
+	}
+	return h->max;
+}
+
+/*
+ * eval_mm_latency - Replay the trace like eval_mm_speed, timing each
+ *     request with the cycle counter into hists[ALLOC], hists[FREE]
+ *     and hists[REALLOC]. With hists NULL, only replay (to warm up).
+ */
+static void eval_mm_latency(trace_t *trace, lat_hist_t *hists)
+{
+	int i, index;
+	char *p;
+	unsigned long long start, cycles;
+	lat_hist_t *h;
+
+	if (hists != NULL)
+		memset(hists, 0, 3 * sizeof(lat_hist_t));
+	reinit_trace(trace);
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in eval_mm_latency");
+
+	for (i = 0;  i < trace->num_ops;  i++) {
+		index = trace->ops[i].index;
+		start = read_cycles();
+		switch (trace->ops[i].type) {
+
+			case ALLOC: /* mm_malloc */
+				if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+					app_error("mm_malloc error in eval_mm_latency");
+				break;
+
+			case REALLOC: /* mm_realloc */
+				if ((p = mm_realloc(trace->blocks[index], trace->ops[i].size)) == NULL
+						&& trace->ops[i].size != 0)
+					app_error("mm_realloc error in eval_mm_latency");
+				break;
+
+			case FREE: /* mm_free */
+				mm_free(index < 0 ? NULL : trace->blocks[index]);
+				p = NULL;
+				break;
+
+			default:
+				app_error("Nonexistent request type in eval_mm_latency");
+		}
+		cycles = read_cycles() - start;
+
+		if (trace->ops[i].type != FREE)
+			trace->blocks[index] = p;
+		if (hists != NULL) {
+			h = &hists[trace->ops[i].type];
+			h->counts[lat_bucket(cycles)]++;
+			h->total++;
+			if (cycles > h->max)
+				h->max = cycles;
+		}
+	}
+}
+
+/*
+ * touch_write - Write the payload of a block that was just allocated,
+ *     as much of it as touch_mode says
+ */
+static void touch_write(char *p, size_t size)
+{
+	size_t off;
+
+	switch (touch_mode) {
+		case TOUCH_HEAD:
+			p[0] = (char)size;
+			break;
+		case TOUCH_LINES:
+			for (off = 0; off < size; off += TOUCH_LINE)
+				p[off] = (char)off;
+			break;
+		case TOUCH_ALL:
+			memset(p, (int)size, size);
+			break;
+	}
+}
+
+/*
+ * touch_read - Read back what touch_write wrote, before the block is
+ *     freed
+ */
+static unsigned long touch_read(const char *p, size_t size)
+{
+	unsigned long sum = 0;
+	size_t off;
+
+	switch (touch_mode) {
+		case TOUCH_HEAD:
+			sum = p[0];
+			break;
+		case TOUCH_LINES:
+			for (off = 0; off < size; off += TOUCH_LINE)
+				sum += p[off];
+			break;
+		case TOUCH_ALL:
+			for (off = 0; off < size; off++)
+				sum += p[off];
+			break;
+	}
+	return sum;
+}
+
+/*
+ * eval_mm_touch - Replay the trace like eval_mm_speed, but use the
+ *     memory as a program would: touch_write each new block, touch_read
+ *     it before it is freed, and after every request read the first byte
+ *     of the touch_hot most recently allocated blocks that are still
+ *     live. An allocator that scatters blocks allocated together over
+ *     many cache lines and pages pays for it here. The cycles of the
+ *     replay go to *cycles and the perfctr events to *ctr; with cycles
+ *     NULL, only replay (to warm up).
+ */
+static void eval_mm_touch(trace_t *trace, unsigned long long *cycles,
+		perfctr_t *ctr)
+{
+	int i, j, index, next_hot = 0;
+	int *hot = NULL;
+	size_t size;
+	char *p;
+	unsigned long sum = 0;
+	unsigned long long start = 0;
+
+	if (touch_hot > 0) {
+		if ((hot = malloc(touch_hot * sizeof(*hot))) == NULL)
+			unix_error("malloc failed in eval_mm_touch");
+		for (j = 0; j < touch_hot; j++)
+			hot[j] = -1;
+	}
+	reinit_trace(trace);
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in eval_mm_touch");
+
+	if (cycles != NULL) {
+		perfctr_init();
+		perfctr_start();
+		start = read_cycles();
+	}
+	for (i = 0;  i < trace->num_ops;  i++) {
+		index = trace->ops[i].index;
+		size = trace->ops[i].size;
+		switch (trace->ops[i].type) {
+
+			case ALLOC: /* mm_malloc */
+				if ((p = mm_malloc(size)) == NULL)
+					app_error("mm_malloc error in eval_mm_touch");
+				break;
+
+			case REALLOC: /* mm_realloc */
+				if ((p = mm_realloc(trace->blocks[index], size)) == NULL
+						&& size != 0)
+					app_error("mm_realloc error in eval_mm_touch");
+				break;
+
+			case FREE: /* mm_free */
+				p = index < 0 ? NULL : trace->blocks[index];
+				if (p != NULL) {
+					sum += touch_read(p, trace->block_sizes[index]);
+					trace->blocks[index] = NULL;
+				}
+				mm_free(p);
+				p = NULL;
+				break;
+
+			default:
+				app_error("Nonexistent request type in eval_mm_touch");
+		}
+
+		if (p != NULL) {
+			touch_write(p, size);
+			trace->blocks[index] = p;
+			trace->block_sizes[index] = size;
+			if (hot != NULL) {
+				hot[next_hot] = index;
+				next_hot = (next_hot + 1) % touch_hot;
+			}
+		} else if (trace->ops[i].type == REALLOC) {
+			trace->blocks[index] = NULL;
+		}
+		for (j = 0; j < touch_hot; j++)
+			if (hot[j] >= 0 && trace->blocks[hot[j]] != NULL)
+				sum += trace->blocks[hot[j]][0];
+	}
+	if (cycles != NULL) {
+		*cycles = read_cycles() - start;
+		perfctr_stop(ctr);
+	}
+	touch_sink = sum;
+	free(hot);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1188,17 +2153,19 @@ static void printresults(int n, stats_t *stats)
 	int sumweight = 0;
 
 	/* Print the individual results for each trace */
-	printf("  %6s%6s %5s%8s%9s  %s\n",
-			"valid", "util", "ops", "secs", "Kops", "trace");
+	printf("  %6s%6s %5s%8s%9s%8s%7s  %s\n",
+			"valid", "util", "ops", "secs", "Kops", "heapKB", "rssKB", "trace");
 	for (i=0; i < n; i++) {
 		if (stats[i].valid) {
-			printf("%2s%4s %5.0f%%%8.0f%10.6f%6.0f %s\n",
+			printf("%2s%4s %5.0f%%%8.0f%10.6f%6.0f%8.0f%7.0f %s\n",
 					stats[i].weight != 0 ? "*" : "",
 					"yes",
 					stats[i].util*100.0,
 					stats[i].ops,
 					stats[i].secs,
 					(stats[i].ops/1e3)/stats[i].secs,
+					stats[i].heapsize/1024,
+					stats[i].resident/1024,
 					stats[i].filename);
 			sumweight += stats[i].weight;
 			sumsecs += stats[i].secs * stats[i].weight;
@@ -1206,13 +2173,15 @@ static void printresults(int n, stats_t *stats)
 			sumutil += stats[i].util * stats[i].weight;
 		}
 		else {
-			printf("%2s%4s %6s%8s%9s%6s %s\n",
+			printf("%2s%4s %6s%8s%9s%6s%8s%7s %s\n",
 					stats[i].weight != 0 ? "*" : "",
 					"no",
 					"-",
 					"-",
 					"-",
 					"-",
+					"-",
+					"-",
 					stats[i].filename);
 		}
 	}
@@ -1235,7 +2204,48 @@ static void printresults(int n, stats_t *stats)
 				"-");
 	}
 
+#if USE_PERFCTR
+	print_perfctr(n, stats);
+#endif
+}
+
+#if USE_PERFCTR
+/*
+ * print_perfctr - Print the events per request that fsecs counted in
+ *     one more run of each valid trace
+ */
+static void print_perfctr(int n, stats_t *stats)
+{
+	/* columns, in the order of perfctr_t.count */
+	static const char *names[PERFCTR_NUM] = { "cyc/op", "inst/op", "LLC/op", "L1D/op" };
+	const perfctr_t *c;
+	int i, e;
+
+	printf("\n  ");
+	for (e = 0; e < PERFCTR_NUM; e++)
+		printf("%9s", names[e]);
+	printf("%6s  %s\n", "CPI", "trace");
+	for (i = 0; i < n; i++) {
+		if (!stats[i].valid)
+			continue;
+		c = &stats[i].ctr;
+		printf("  ");
+		for (e = 0; e < PERFCTR_NUM; e++) {
+			if (c->valid[e])
+				printf("%9.1f", c->count[e] / stats[i].ops);
+			else
+				printf("%9s", "n/a");
+		}
+		if (c->valid[PERFCTR_CYCLES] && c->valid[PERFCTR_INSTRUCTIONS] &&
+				c->count[PERFCTR_INSTRUCTIONS] != 0)
+			printf("%6.2f", (double)c->count[PERFCTR_CYCLES] /
+					c->count[PERFCTR_INSTRUCTIONS]);
+		else
+			printf("%6s", "n/a");
+		printf("  %s\n", stats[i].filename);
+	}
 }
+#endif
 
 /*
  * app_error - Report an arbitrary application error
@@ -1277,6 +2287,88 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
 	va_end(ap);
 }
 
+/*
+ * print_mm_stats - Print the counters that mm_stats reports for the
+ *     trace that eval_mm_util just replayed
+ */
+static void print_mm_stats(const char *filename)
+{
+	mm_stats_t st;
+	int i;
+
+	mm_stats(&st);
+	printf("\nAllocator statistics for %s:\n", filename);
+	printf("  malloc %lu  free %lu  realloc %lu\n",
+			st.malloc_calls, st.free_calls, st.realloc_calls);
+	printf("  find_fit %lu calls, %.2f steps/call\n", st.fit_calls,
+			st.fit_calls ? (double)st.fit_steps / st.fit_calls : 0.0);
+	printf("  extend_heap %lu  split %lu  coalesce %lu\n",
+			st.extend_calls, st.splits, st.coalesces);
+	printf("  heap %luKB  in use %luKB  largest free %luKB\n",
+			(unsigned long)(st.heap_bytes / 1024),
+			(unsigned long)(st.in_use_bytes / 1024),
+			(unsigned long)(st.largest_free / 1024));
+	printf("  class  free blocks      freeKB\n");
+	for (i = 0; i < st.class_num && i < MM_STATS_CLASS_MAX; i++) {
+		if (st.class_free_blocks[i] == 0)
+			continue;
+		printf("  %5d %12lu %11lu\n", i, st.class_free_blocks[i],
+				(unsigned long)(st.class_free_bytes[i] / 1024));
+	}
+}
+
+/*
+ * print_latency_hists - Print the latency percentiles in cycles of each
+ *     request type that eval_mm_latency measured
+ */
+static void print_latency_hists(const char *filename, lat_hist_t *hists)
+{
+	/* indexed by ALLOC, FREE, REALLOC */
+	static const char *names[3] = { "malloc", "free", "realloc" };
+	int t;
+
+	printf("\nLatency in cycles for %s:\n", filename);
+	printf("  %-8s %8s %8s %8s %8s %10s\n",
+			"request", "count", "p50", "p99", "p99.9", "max");
+	for (t = 0; t < 3; t++) {
+		if (hists[t].total == 0)
+			continue;
+		printf("  %-8s %8lu %8llu %8llu %8llu %10llu\n", names[t],
+				hists[t].total,
+				lat_percentile(&hists[t], 0.5),
+				lat_percentile(&hists[t], 0.99),
+				lat_percentile(&hists[t], 0.999),
+				hists[t].max);
+	}
+}
+
+/*
+ * print_touch - Print the cycles and the perfctr events per request
+ *     that eval_mm_touch measured
+ */
+static void print_touch(const trace_t *trace, unsigned long long cycles,
+		const perfctr_t *ctr)
+{
+	double ops = trace->num_ops ? trace->num_ops : 1;
+	int i;
+
+	printf("\nPayload touching (%s, %d hot) for %s:\n",
+			touch_names[touch_mode], touch_hot, trace->filename);
+	printf("  %-14s %14llu %10.1f/request\n", "cycle counter",
+			cycles, cycles / ops);
+	for (i = 0; i < PERFCTR_NUM; i++) {
+		if (ctr->valid[i])
+			printf("  %-14s %14llu %10.2f/request\n", perfctr_name(i),
+					ctr->count[i], ctr->count[i] / ops);
+		else
+			printf("  %-14s %14s\n", perfctr_name(i), "n/a");
+	}
+	if (ctr->valid[PERFCTR_CYCLES] && ctr->valid[PERFCTR_INSTRUCTIONS] &&
+			ctr->count[PERFCTR_CYCLES] != 0)
+		printf("  %-14s %14.2f\n", "IPC", (double)ctr->count[PERFCTR_INSTRUCTIONS] /
+				ctr->count[PERFCTR_CYCLES]);
+}
+
 /*
  * usage - Explain the command line arguments
  */
@@ -1293,5 +2385,14 @@ static void usage(void)
 	fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
 	fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
 	fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
-	fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+	fprintf(stderr, "\t-f <file>  Use <file> as the trace file (text or rep2bin binary).\n");
+	fprintf(stderr, "\t-S         Print allocator statistics after each trace.\n");
+	fprintf(stderr, "\t-L         Print per-request latency percentiles after each trace.\n");
+	fprintf(stderr, "\t-F <n>     Write <trace>.frag.csv with a sample every <n> requests.\n");
+	fprintf(stderr, "\t-P <p>     Replay touching the payloads, <p> = head|lines|all[:<hot>].\n");
+	fprintf(stderr, "\t-j <n>     Evaluate the traces in <n> worker processes, one per CPU.\n");
+#ifdef THREAD_SAFE
+	fprintf(stderr, "\t-T <n>     Also replay each trace with 1, 2, 4, ... <n> threads.\n");
+	fprintf(stderr, "\t-a <n>     Split the heap into <n> arenas for -T (default one per thread).\n");
+#endif
 }
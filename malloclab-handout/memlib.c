@@ -3,6 +3,7 @@
  *						allows us to interleave calls from the student's malloc package
  *						with the system's malloc package in libc.
  */
+#define _GNU_SOURCE            /* mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -17,13 +18,64 @@
 
 /* private variables */
 static char *heap;
-static char *mem_brk;
-static char *mem_max_addr;
+
+/*
+ * The heap is split into arena_num slices of arena_size bytes. Each
+ * slice has its own brk, so arenas grow independently.
+ */
+static int arena_num;
+static size_t arena_size;
+static char *arena_brk[MEM_ARENA_MAX];
+
+/*
+ * Bytes below all brks plus the bytes in mem_map mappings, and the most
+ * there has been since the last reset
+ */
+static size_t heap_used;
+static size_t heap_peak;
+
+/*
+ * Each mem_map mapping starts with a mem_map_t that links it into a
+ * list of all mappings; the caller gets the bytes after it. The list is
+ * guarded by a spin lock since mappings bypass the arena brks.
+ */
+typedef struct mem_map_t {
+	struct mem_map_t *next;
+	struct mem_map_t *prev;
+	size_t len;              /* length of the whole mapping */
+	size_t pad;              /* keep the caller's bytes 16-byte aligned */
+} mem_map_t;
+
+static mem_map_t *map_list;
+static char map_lock;
+
+#define MAP_LOCK()   while (__atomic_test_and_set(&map_lock, __ATOMIC_ACQUIRE))
+#define MAP_UNLOCK() __atomic_clear(&map_lock, __ATOMIC_RELEASE)
+
+static void mem_account(long incr);
+static void map_link(mem_map_t *m);
+static void map_unlink(mem_map_t *m);
+static size_t resident_pages(char *lo, char *hi);
+
+#define PAGE_DOWN(p) ((char *)((size_t)(p) & ~(mem_pagesize() - 1)))
+#define PAGE_UP(p)   PAGE_DOWN((char *)(p) + mem_pagesize() - 1)
 
 /*
  * mem_init - initialize the memory system model
  */
 void mem_init(void){
+#ifdef PRELOAD
+	/*
+	 * libmm.so: reserve the address space without committing swap;
+	 * a page is backed by memory when the allocator first touches it
+	 */
+	heap = mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (heap == MAP_FAILED) {
+		fprintf(stderr, "ERROR: mem_init failed to reserve the heap\n");
+		exit(1);
+	}
+#else
 	int dev_zero = open("/dev/zero", O_RDWR);
 	heap = mmap((void *)0x800000000, /* suggested start*/
 			MAX_HEAP,				/* length */
@@ -31,8 +83,8 @@ void mem_init(void){
 			MAP_PRIVATE,			/* private or shared? */
 			dev_zero,				/* fd */
 			0);						/* offset (dunno) */
-	mem_max_addr = heap + MAX_HEAP;
-	mem_brk = heap;					/* heap is empty initially */
+#endif
+	mem_arena_setup(1);				/* heap is empty initially */
 }
 
 /*
@@ -43,29 +95,229 @@ void mem_deinit(void){
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointers and remove every
+ *		mem_map mapping to make an empty heap
  */
 void mem_reset_brk(){
-	mem_brk = heap;
+	int i;
+
+	for (i = 0; i < arena_num; i++)
+		arena_brk[i] = heap + i * arena_size;
+	while (map_list != NULL)
+		mem_unmap(map_list + 1);
+	heap_used = 0;
+	heap_peak = 0;
+}
+
+/*
+ * mem_arena_setup - split the heap into num equal, page-aligned arenas
+ *		and make all of them empty. Returns -1 if num is out of range.
+ */
+int mem_arena_setup(int num){
+	if (num < 1 || num > MEM_ARENA_MAX)
+		return -1;
+
+	arena_num = num;
+	arena_size = (MAX_HEAP / num) & ~(mem_pagesize() - 1);
+	mem_reset_brk();
+	return 0;
+}
+
+/*
+ * mem_arena_num - return the number of arenas
+ */
+int mem_arena_num(){
+	return arena_num;
+}
+
+/*
+ * mem_arena_index - return the arena that contains p, or -1
+ */
+int mem_arena_index(const void *p){
+	size_t offset = (size_t)((const char *)p - heap);
+
+	if ((const char *)p < heap || offset >= arena_size * arena_num)
+		return -1;
+	return (int)(offset / arena_size);
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
- *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+ *		by incr bytes and returns the start address of the new area.
+ *		A negative incr shrinks the heap and returns its pages to the
+ *		system.
  */
 void *mem_sbrk(int incr) {
-	char *old_brk = mem_brk;
+	void *p = mem_arena_sbrk(0, incr);
 
-	if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
-		errno = ENOMEM;
+	if (p == (void *)-1)
 		fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
-		return (void *)-1;
+	return p;
+}
+
+/*
+ * mem_arena_sbrk - mem_sbrk for one arena. The brk is moved with
+ *		a compare-and-swap so concurrent callers get disjoint areas.
+ *		Fails quietly, since the caller may fall back to another arena.
+ */
+void *mem_arena_sbrk(int arena, int incr) {
+	char *min_addr = heap + arena * arena_size;
+	char *max_addr = min_addr + arena_size;
+	char *old_brk = __atomic_load_n(&arena_brk[arena], __ATOMIC_RELAXED);
+
+	do {
+		if ((old_brk + incr < min_addr) || ((old_brk + incr) > max_addr)) {
+			errno = ENOMEM;
+			return (void *)-1;
+		}
+	} while (!__atomic_compare_exchange_n(&arena_brk[arena], &old_brk, old_brk + incr, 0,
+	                                      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	mem_account(incr);
+	if (incr < 0) {
+		/* the pages wholly above the new brk */
+		mem_release(old_brk + incr, PAGE_UP(old_brk) - (old_brk + incr));
 	}
-	mem_brk += incr;
 	return (void *)old_brk;
 }
 
+/*
+ * mem_account - add incr bytes to heap_used and raise heap_peak
+ */
+static void mem_account(long incr) {
+	size_t used = __atomic_add_fetch(&heap_used, (size_t)incr, __ATOMIC_RELAXED);
+	size_t peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+
+	while (used > peak && !__atomic_compare_exchange_n(&heap_peak, &peak, used, 0,
+	                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * mem_map - map at least len bytes of fresh zeroed memory outside the
+ *		heap. Returns a 16-byte aligned pointer that lies in the first
+ *		page of the mapping, or (void *)-1.
+ */
+void *mem_map(size_t len) {
+	size_t maplen = (size_t)PAGE_UP(len + sizeof(mem_map_t));
+	mem_map_t *m = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+	                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (m == MAP_FAILED) {
+		errno = ENOMEM;
+		return (void *)-1;
+	}
+	m->len = maplen;
+	map_link(m);
+	mem_account((long)maplen);
+	return (void *)(m + 1);
+}
+
+/*
+ * mem_unmap - remove a mapping made by mem_map
+ */
+void mem_unmap(void *p) {
+	mem_map_t *m = (mem_map_t *)p - 1;
+
+	map_unlink(m);
+	mem_account(-(long)m->len);
+	munmap(m, m->len);
+}
+
+/*
+ * mem_remap - resize a mapping made by mem_map to at least len bytes,
+ *		possibly moving it. Returns the new pointer, or (void *)-1 and
+ *		leaves the old mapping alone.
+ */
+void *mem_remap(void *p, size_t len) {
+	mem_map_t *m = (mem_map_t *)p - 1;
+	size_t oldlen = m->len;
+	size_t maplen = (size_t)PAGE_UP(len + sizeof(mem_map_t));
+	mem_map_t *n;
+
+	if (maplen == oldlen)
+		return p;
+
+	/* unlink first: the neighbours point at the old address */
+	map_unlink(m);
+	n = mremap(m, oldlen, maplen, MREMAP_MAYMOVE);
+	if (n == MAP_FAILED) {
+		map_link(m);
+		errno = ENOMEM;
+		return (void *)-1;
+	}
+	n->len = maplen;
+	map_link(n);
+	mem_account((long)maplen - (long)oldlen);
+	return (void *)(n + 1);
+}
+
+/*
+ * mem_is_mapped - is [lo, hi] inside the caller's part of one mapping?
+ */
+int mem_is_mapped(const void *lo, const void *hi) {
+	mem_map_t *m;
+	int found = 0;
+
+	MAP_LOCK();
+	for (m = map_list; m != NULL && !found; m = m->next)
+		found = (const char *)lo >= (const char *)(m + 1) &&
+			(const char *)hi < (const char *)m + m->len;
+	MAP_UNLOCK();
+	return found;
+}
+
+/*
+ * mem_fork_prepare, mem_fork_parent, mem_fork_child - pthread_atfork
+ *		handlers. A thread that holds map_lock while another one forks
+ *		does not exist in the child, so the lock is taken before fork
+ *		and released on both sides.
+ */
+void mem_fork_prepare(void) {
+	MAP_LOCK();
+}
+
+void mem_fork_parent(void) {
+	MAP_UNLOCK();
+}
+
+void mem_fork_child(void) {
+	MAP_UNLOCK();
+}
+
+static void map_link(mem_map_t *m) {
+	MAP_LOCK();
+	m->prev = NULL;
+	m->next = map_list;
+	if (map_list != NULL)
+		map_list->prev = m;
+	map_list = m;
+	MAP_UNLOCK();
+}
+
+static void map_unlink(mem_map_t *m) {
+	MAP_LOCK();
+	if (m->prev != NULL)
+		m->prev->next = m->next;
+	else
+		map_list = m->next;
+	if (m->next != NULL)
+		m->next->prev = m->prev;
+	MAP_UNLOCK();
+}
+
+/*
+ * mem_release - give the whole pages in [addr, addr + len) back to the
+ *		system. They stay mapped and read as zero when touched again.
+ */
+void mem_release(void *addr, size_t len) {
+	char *lo = PAGE_UP(addr);
+	char *hi = PAGE_DOWN((char *)addr + len);
+
+	if (lo < hi)
+		madvise(lo, hi - lo, MADV_DONTNEED);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -74,17 +326,77 @@ void *mem_heap_lo(){
 }
 
 /*
- * mem_heap_hi - return address of last heap byte
+ * mem_heap_hi - return address of last heap byte, in the highest
+ *		arena that is not empty
  */
 void *mem_heap_hi(){
-	return (void *)(mem_brk - 1);
+	int i;
+
+	for (i = arena_num - 1; i > 0; i--)
+		if (arena_brk[i] != heap + i * arena_size)
+			break;
+	return (void *)(arena_brk[i] - 1);
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes, summed over arenas
  */
 size_t mem_heapsize() {
-	return (size_t)((void *)mem_brk - (void *)heap);
+	return heap_used;
+}
+
+/*
+ * mem_heap_peak() - returns the largest heap size since the last reset
+ */
+size_t mem_heap_peak() {
+	return heap_peak;
+}
+
+/*
+ * mem_resident() - returns the number of heap bytes below the brks and
+ *		in mem_map mappings that are resident in memory
+ */
+size_t mem_resident() {
+	size_t resident = 0;
+	mem_map_t *m;
+	int i;
+
+	for (i = 0; i < arena_num; i++)
+		resident += resident_pages(heap + i * arena_size, PAGE_UP(arena_brk[i]));
+	for (m = map_list; m != NULL; m = m->next)
+		resident += resident_pages((char *)m, (char *)m + m->len);
+	return resident * mem_pagesize();
+}
+
+/*
+ * resident_pages - count the resident pages in [lo, hi), both page-aligned
+ */
+static size_t resident_pages(char *lo, char *hi) {
+	size_t pages = (hi - lo) / mem_pagesize();
+	size_t resident = 0, j;
+	unsigned char *vec;
+
+	if (pages == 0 || (vec = malloc(pages)) == NULL)
+		return 0;
+	if (mincore(lo, pages * mem_pagesize(), vec) == 0)
+		for (j = 0; j < pages; j++)
+			resident += vec[j] & 0x1;
+	free(vec);
+	return resident;
+}
+
+/*
+ * mem_arena_lo - return address of the first byte of an arena
+ */
+void *mem_arena_lo(int arena){
+	return (void *)(heap + arena * arena_size);
+}
+
+/*
+ * mem_arena_hi - return address of the last used byte of an arena
+ */
+void *mem_arena_hi(int arena){
+	return (void *)(arena_brk[arena] - 1);
 }
 
 /*
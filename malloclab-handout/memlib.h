@@ -7,5 +7,32 @@ void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_heap_peak(void);
+size_t mem_resident(void);
 size_t mem_pagesize(void);
+void mem_release(void *addr, size_t len);
+
+/* Mappings outside the heap, for allocations too large for it */
+void *mem_map(size_t len);
+void mem_unmap(void *p);
+void *mem_remap(void *p, size_t len);
+int mem_is_mapped(const void *lo, const void *hi);
+
+/* fork handlers: hold the mapping list lock across fork */
+void mem_fork_prepare(void);
+void mem_fork_parent(void);
+void mem_fork_child(void);
+
+/*
+ * The reserved mapping can be split into up to MEM_ARENA_MAX arenas,
+ * each with its own brk. mem_sbrk extends arena 0.
+ */
+#define MEM_ARENA_MAX 16
+
+int mem_arena_setup(int num);
+int mem_arena_num(void);
+int mem_arena_index(const void *p);
+void *mem_arena_sbrk(int arena, int incr);
+void *mem_arena_lo(int arena);
+void *mem_arena_hi(int arena);
 
@@ -0,0 +1,632 @@
+/*
+ * mm-tlsf.c - 两级分离适配 (Two-Level Segregated Fit, TLSF) 分配器
+ *
+ * 和 mm.c 使用同一个 memlib.c 的 mem_sbrk 堆，编译时二选一：
+ *     make mdriver       -- mm.c 的分离空闲链表
+ *     make mdriver-tlsf  -- 本文件的 TLSF
+ * 两个 mdriver 使用相同的 trace ，可以直接对比吞吐率和利用率
+ *
+ * 整体设计：
+ * 1. block 的格式和 mm.c 相同，hdrp - pred - succ - ftrp ，最小块为 4 个指针大小
+ * 1. 第一级按照 2 的幂次划分 [2^fl, 2^(fl+1)) ，第二级把每个区间再均分为 SL_INDEX_COUNT 份
+ * 1. 小于 SMALL_BLOCK_SIZE 的 block 放在第一级的第 0 组，第二级按照 SMALL_BLOCK_SIZE / SL_INDEX_COUNT 线性划分
+ * 1. 每一级都有一个位图，标记哪些空闲链表非空，查找时只需要两次 ffs ，不需要遍历链表
+ * 1. 空闲链表不排序，总是在头部插入，因此 malloc 和 free 都是 O(1)
+ * 1. 查找时把 size 向上取整到下一个第二级区间的起点，区间里的任意 block 都满足要求（good fit），碎片有上界
+ * 1. 位图和链表入口保存在堆的起始位置，和 mm.c 的分离空闲链表入口相同
+ * 1. mm_stats 的每组空闲 block 按第一级区间统计
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+/* If you want debugging output, use the following macro.  When you hand
+ * in, remove the #define DEBUG line. */
+//#define DEBUG
+#ifdef DEBUG
+# define dbg_printf(...) printf(__VA_ARGS__)
+#else
+# define dbg_printf(...)
+#endif
+
+
+/* do not change the following! */
+#ifdef DRIVER
+/* create aliases for driver tests */
+#define malloc mm_malloc
+#define free mm_free
+#define realloc mm_realloc
+#define calloc mm_calloc
+#endif /* def DRIVER */
+
+/* single word (4) or double word (8) alignment */
+#define ALIGNMENT 8
+/* expand heap by this amount (bytes) */
+#define CHUNKSIZE (1<<12)
+/* rounds up to the nearest multiple of ALIGNMENT */
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
+/* hdr ftr pred succ -- size  自动适配 32 64 位系统 */
+#define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
+/* block 最小值 header footer pred succ */
+#define MIN_BLOCK_SIZE (4 * SIZE_T_SIZE)
+/* 和 mm.c 相同，超过的请求直接失败，ALIGN 不会溢出 */
+#define MAX_REQUEST_SIZE (1UL << 31)
+
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/* pack size and allocated bit */
+#define PACK(size, alloc)  ((size) | (alloc))
+
+/* read and write -- at address p */
+#define GET(p)       (*(size_t *)(p))
+#define PUT(p, val)  (*(size_t *)(p) = val)
+
+/* read the size and allocated bit from address p */
+#define GET_SIZE(p)   (GET(p) & ~0x7)
+#define GET_ALLOC(p)  (GET(p) & 0x1)
+
+/* Given block ptr bp, computer address of its header and footer */
+#define HDRP(bp)  ((char *)(bp) - SIZE_T_SIZE)
+#define FTRP(bp)  ((char *)(bp) + GET_SIZE(HDRP(bp)) - 2 * SIZE_T_SIZE)
+
+/* Given block ptr bp, computer address of previous and next blocks */
+#define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE((char *)(bp) - 2 * SIZE_T_SIZE))
+#define NEXT_BLKP(bp)  ((char *)(bp) + GET_SIZE(HDRP(bp)))
+
+/* Given free block ptr bp, compute address of its preceding free block and succeeding block */
+#define PRED_BLKP(bp)  (*(char **)(bp))
+#define SUCC_BLKP(bp)  (*(char **)((char *)(bp) + SIZE_T_SIZE))
+
+/*
+ * 两级索引的参数
+ * 1. 第二级把每个 2 的幂次区间划分为 2^SL_INDEX_COUNT_LOG2 = 8 份
+ * 1. 小于 SMALL_BLOCK_SIZE = 2^(SL_INDEX_COUNT_LOG2 + ALIGN_SHIFT) = 64 的 block 按 8 字节线性划分
+ * 1. memlib 的 MAX_HEAP 为 100 MB < 2^27 ，第一级最大到 2^FL_INDEX_MAX 就足够了
+ */
+#define ALIGN_SHIFT          (3)
+#define SL_INDEX_COUNT_LOG2  (3)
+#define SL_INDEX_COUNT       (1 << SL_INDEX_COUNT_LOG2)
+#define FL_INDEX_MAX         (27)
+#define FL_INDEX_SHIFT       (SL_INDEX_COUNT_LOG2 + ALIGN_SHIFT)
+#define FL_INDEX_COUNT       (FL_INDEX_MAX - FL_INDEX_SHIFT + 1)
+#define SMALL_BLOCK_SIZE     (1 << FL_INDEX_SHIFT)
+
+/*
+ * 保存在堆起始位置的控制结构
+ * fl_bitmap 的第 fl 位表示 sl_bitmap[fl] 非空
+ * sl_bitmap[fl] 的第 sl 位表示 blocks[fl][sl] 链表非空
+ */
+typedef struct
+{
+    uint32_t fl_bitmap;
+    uint32_t sl_bitmap[FL_INDEX_COUNT];
+    char     *blocks[FL_INDEX_COUNT][SL_INDEX_COUNT];
+} tlsf_control_t;
+
+#define CONTROL_SIZE (ALIGN(sizeof(tlsf_control_t)))
+
+// global variable
+static tlsf_control_t *control    = NULL;
+static char           *heap_listp = NULL;
+/* 统计计数，mm_init 时清零 */
+static mm_stats_t     tlsf_stats;
+
+#define MEM_SUCCESS (0)
+#define MEM_ERROR   (-1)
+
+/* 内部函数声明 */
+static void *extend_heap(size_t bytes);
+static void *coalesce(void *bp);
+static void *find_fit(size_t asize);
+static void place(void *bp, size_t asize);
+static void mapping_insert(size_t size, int *fli, int *sli);
+static void mapping_search(size_t size, int *fli, int *sli);
+static void insert_free_block(void *bp);
+static void remove_free_block(void *bp);
+
+/*
+ * 最高位 1 的位置，size 不能为 0
+ */
+static inline int tlsf_fls(size_t size)
+{
+    return (int)(sizeof(unsigned long) * 8) - 1 - __builtin_clzl(size);
+}
+
+/*
+ * 最低位 1 的位置，word 不能为 0
+ */
+static inline int tlsf_ffs(uint32_t word)
+{
+    return __builtin_ctz(word);
+}
+
+/*
+ * mm_init - Called when a new trace starts.
+ * 作用：
+ * 1. 在堆的起始位置初始化控制结构，所有链表为空
+ * 1. 初始化序言块和结尾块
+ * 1. 申请一定大小的空间，调用 extend_heap 函数实现
+ */
+int mm_init(void)
+{
+    memset(&tlsf_stats, 0, sizeof(tlsf_stats));
+
+    control = (tlsf_control_t *)mem_sbrk(CONTROL_SIZE + 4 * SIZE_T_SIZE);
+    if ((void *)control == (void *)MEM_ERROR)
+    {
+        return MEM_ERROR;
+    }
+    memset(control, 0, CONTROL_SIZE);
+
+    heap_listp = (char *)control + CONTROL_SIZE;
+    PUT(heap_listp, 0); /* 32 位的时候，需要的对齐块 */
+    PUT(heap_listp + 1 * SIZE_T_SIZE, PACK(2 * SIZE_T_SIZE, 1)); /* prologue header */
+    PUT(heap_listp + 2 * SIZE_T_SIZE, PACK(2 * SIZE_T_SIZE, 1)); /* prologue footer */
+    PUT(heap_listp + 3 * SIZE_T_SIZE, PACK(0, 1)); /* epilogue header */
+    heap_listp += 2 * SIZE_T_SIZE;
+
+    char *bp = extend_heap(CHUNKSIZE);
+    if (bp == NULL)
+    {
+        return MEM_ERROR;
+    }
+    insert_free_block(bp);
+
+#ifdef DEBUG
+    mm_checkheap(__LINE__);
+#endif
+    return 0;
+}
+
+/*
+ * malloc - Allocate a block
+ *
+ * 1. size 为 0 或者不小于 MAX_REQUEST_SIZE 时返回 NULL
+ * 1. 调整 size ，满足对齐和最小块的要求
+ * 1. 通过两级位图找到满足要求的链表，取链表的第一个 block
+ * 1. 找不到则扩张堆
+ */
+void *malloc(size_t size)
+{
+    tlsf_stats.malloc_calls++;
+    if (size == 0 || size >= MAX_REQUEST_SIZE)
+    {
+        return NULL;
+    }
+
+    size_t asize = MAX(ALIGN(size + 2 * SIZE_T_SIZE), MIN_BLOCK_SIZE);
+    void   *bp   = find_fit(asize);
+
+    if (bp != NULL)
+    {
+        place(bp, asize);
+        dbg_printf("malloc size %lu, asize %lu => %p\n", size, asize, bp);
+    }
+
+#ifdef DEBUG
+    mm_checkheap(__LINE__);
+#endif
+    return bp;
+}
+
+/*
+ * free - 清空 allocated bit ，合并后插入对应的链表
+ */
+void free(void *ptr)
+{
+    tlsf_stats.free_calls++;
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    size_t size = GET_SIZE(HDRP(ptr));
+    dbg_printf("free size %lu => %p\n", size, ptr);
+
+    PUT(HDRP(ptr), PACK(size, 0));
+    PUT(FTRP(ptr), PACK(size, 0));
+    insert_free_block(coalesce(ptr));
+
+#ifdef DEBUG
+    mm_checkheap(__LINE__);
+#endif
+}
+
+/*
+ * realloc - 新的 size 不超过当前 block 时直接返回，否则 malloc - copy - free
+ */
+void *realloc(void *oldptr, size_t size)
+{
+    tlsf_stats.realloc_calls++;
+    if (size == 0)
+    {
+        free(oldptr);
+        return NULL;
+    }
+
+    if (oldptr == NULL)
+    {
+        return malloc(size);
+    }
+
+    size_t oldsize = GET_SIZE(HDRP(oldptr)) - 2 * SIZE_T_SIZE;
+    if (size <= oldsize)
+    {
+        return oldptr;
+    }
+
+    void *newptr = malloc(size);
+    /* If realloc() fails the original block is left untouched  */
+    if (newptr == NULL)
+    {
+        return NULL;
+    }
+
+    memcpy(newptr, oldptr, oldsize);
+    free(oldptr);
+
+    return newptr;
+}
+
+/*
+ * calloc - Allocate the block and set it to zero.
+ */
+void *calloc(size_t nmemb, size_t size)
+{
+    size_t bytes = nmemb * size;
+
+    // 乘法溢出时失败，否则 memset 会写出 block
+    if (nmemb != 0 && bytes / nmemb != size)
+    {
+        return NULL;
+    }
+
+    void *newptr = malloc(bytes);
+
+    if (newptr != NULL)
+    {
+        memset(newptr, 0, bytes);
+    }
+
+    return newptr;
+}
+
+/*
+ * 扩展堆，新的 block 和前面的 free block 合并，不插入链表，由调用者决定
+ * 只在两个地方调用：mm_init 插入链表，find_fit 直接交给 place 分割
+ */
+static void *extend_heap(size_t bytes)
+{
+    size_t asize = MAX(ALIGN(bytes), MIN_BLOCK_SIZE);
+    char   *bp   = NULL;
+
+    // mem_sbrk 的参数是 int ，接近 MAX_REQUEST_SIZE 的请求加上 header footer 后会超过 INT_MAX
+    if (asize > INT_MAX)
+    {
+        return NULL;
+    }
+
+    bp = (char *)mem_sbrk(asize);
+    if ((void *)bp == (void *)MEM_ERROR)
+    {
+        return NULL;
+    }
+    tlsf_stats.extend_calls++;
+    tlsf_stats.heap_bytes += asize;
+
+    PUT(HDRP(bp), PACK(asize, 0));
+    PUT(FTRP(bp), PACK(asize, 0));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
+
+    return coalesce(bp);
+}
+
+/*
+ * 和前后相邻的 free block 合并
+ * 1. 相邻的 free block 先从链表中删除
+ * 1. 返回合并后的 block ，不在任何链表中
+ */
+static void *coalesce(void *bp)
+{
+    char   *prev = PREV_BLKP(bp);
+    char   *next = NEXT_BLKP(bp);
+    size_t size  = GET_SIZE(HDRP(bp));
+
+    if (!GET_ALLOC(HDRP(next)))
+    {
+        remove_free_block(next);
+        size += GET_SIZE(HDRP(next));
+        tlsf_stats.coalesces++;
+    }
+
+    if (!GET_ALLOC(HDRP(prev)))
+    {
+        remove_free_block(prev);
+        size += GET_SIZE(HDRP(prev));
+        bp = prev;
+        tlsf_stats.coalesces++;
+    }
+
+    PUT(HDRP(bp), PACK(size, 0));
+    PUT(FTRP(bp), PACK(size, 0));
+
+    return bp;
+}
+
+/*
+ * size 所在的链表编号，插入的时候使用
+ */
+static void mapping_insert(size_t size, int *fli, int *sli)
+{
+    if (size < SMALL_BLOCK_SIZE)
+    {
+        *fli = 0;
+        *sli = (int)size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
+    }
+    else
+    {
+        int fl = tlsf_fls(size);
+        *sli = (int)(size >> (fl - SL_INDEX_COUNT_LOG2)) ^ SL_INDEX_COUNT;
+        *fli = fl - (FL_INDEX_SHIFT - 1);
+    }
+}
+
+/*
+ * 查找的时候使用，size 先向上取整到下一个第二级区间的起点，
+ * 这样找到的链表中任意 block 都满足要求，不需要遍历链表
+ */
+static void mapping_search(size_t size, int *fli, int *sli)
+{
+    if (size >= SMALL_BLOCK_SIZE)
+    {
+        size += (1UL << (tlsf_fls(size) - SL_INDEX_COUNT_LOG2)) - 1;
+    }
+    mapping_insert(size, fli, sli);
+}
+
+/*
+ * 在链表头部插入 free block ，设置两级位图
+ */
+static void insert_free_block(void *bp)
+{
+    int fl = 0, sl = 0;
+    mapping_insert(GET_SIZE(HDRP(bp)), &fl, &sl);
+
+    char *head = control->blocks[fl][sl];
+    PRED_BLKP(bp) = NULL;
+    SUCC_BLKP(bp) = head;
+    if (head != NULL)
+    {
+        PRED_BLKP(head) = bp;
+    }
+    control->blocks[fl][sl] = bp;
+
+    control->fl_bitmap     |= (1U << fl);
+    control->sl_bitmap[fl] |= (1U << sl);
+
+    tlsf_stats.class_free_blocks[fl]++;
+    tlsf_stats.class_free_bytes[fl] += GET_SIZE(HDRP(bp));
+}
+
+/*
+ * 从链表中删除 free block ，链表为空时清空位图
+ */
+static void remove_free_block(void *bp)
+{
+    int fl = 0, sl = 0;
+    mapping_insert(GET_SIZE(HDRP(bp)), &fl, &sl);
+
+    char *pred = PRED_BLKP(bp);
+    char *succ = SUCC_BLKP(bp);
+
+    tlsf_stats.class_free_blocks[fl]--;
+    tlsf_stats.class_free_bytes[fl] -= GET_SIZE(HDRP(bp));
+
+    if (succ != NULL)
+    {
+        PRED_BLKP(succ) = pred;
+    }
+
+    if (pred != NULL)
+    {
+        SUCC_BLKP(pred) = succ;
+    }
+    else
+    {
+        // 删除的是头节点
+        control->blocks[fl][sl] = succ;
+        if (succ == NULL)
+        {
+            control->sl_bitmap[fl] &= ~(1U << sl);
+            if (control->sl_bitmap[fl] == 0)
+            {
+                control->fl_bitmap &= ~(1U << fl);
+            }
+        }
+    }
+}
+
+/*
+ * 通过两级位图查找，找不到时扩展堆
+ * 1. 先在同一个第一级区间中找不小于 sl 的第二级链表
+ * 1. 再找更大的第一级区间，取其中最小的第二级链表
+ * 1. 最大的区间超出 FL_INDEX_MAX 时直接扩展堆
+ */
+static void *find_fit(size_t asize)
+{
+    int fl = 0, sl = 0;
+    void *bp = NULL;
+
+    tlsf_stats.fit_calls++;
+    mapping_search(asize, &fl, &sl);
+    if (fl < FL_INDEX_COUNT)
+    {
+        uint32_t sl_map = control->sl_bitmap[fl] & (~0U << sl);
+        if (sl_map == 0)
+        {
+            uint32_t fl_map = (fl + 1 < 32) ? control->fl_bitmap & (~0U << (fl + 1)) : 0;
+            if (fl_map != 0)
+            {
+                fl = tlsf_ffs(fl_map);
+                sl_map = control->sl_bitmap[fl];
+            }
+        }
+
+        if (sl_map != 0)
+        {
+            sl = tlsf_ffs(sl_map);
+            bp = control->blocks[fl][sl];
+            tlsf_stats.fit_steps++;
+            remove_free_block(bp);
+            return bp;
+        }
+    }
+
+    // 合并后的 block 可能比 asize 大，剩余部分由 place 分割
+    return extend_heap(MAX(asize, CHUNKSIZE));
+}
+
+/*
+ * bp 已经从链表中删除，设置 allocated bit ，剩余部分足够大时分割并插入链表
+ */
+static void place(void *bp, size_t asize)
+{
+    size_t size       = GET_SIZE(HDRP(bp));
+    size_t split_size = size - asize;
+
+    if (split_size >= MIN_BLOCK_SIZE)
+    {
+        PUT(HDRP(bp), PACK(asize, 1));
+        PUT(FTRP(bp), PACK(asize, 1));
+
+        char *split_bp = NEXT_BLKP(bp);
+        PUT(HDRP(split_bp), PACK(split_size, 0));
+        PUT(FTRP(split_bp), PACK(split_size, 0));
+        insert_free_block(split_bp);
+        tlsf_stats.splits++;
+    }
+    else
+    {
+        PUT(HDRP(bp), PACK(size, 1));
+        PUT(FTRP(bp), PACK(size, 1));
+    }
+}
+
+/*
+ * mm_stats - 返回统计计数，in_use_bytes 由堆的大小减去链表中的 free block 得到
+ * 最大的 free block 在最高的非空第二级链表中，链表不排序，需要遍历一遍
+ */
+void mm_stats(mm_stats_t *stats)
+{
+    *stats = tlsf_stats;
+    stats->class_num    = FL_INDEX_COUNT;
+    stats->in_use_bytes = stats->heap_bytes;
+    for (int fl = 0; fl < FL_INDEX_COUNT; fl++)
+    {
+        stats->in_use_bytes -= stats->class_free_bytes[fl];
+    }
+
+    stats->largest_free = 0;
+    if (control->fl_bitmap != 0)
+    {
+        int fl = tlsf_fls(control->fl_bitmap);
+        int sl = tlsf_fls(control->sl_bitmap[fl]);
+        for (char *bp = control->blocks[fl][sl]; bp != NULL; bp = SUCC_BLKP(bp))
+        {
+            stats->largest_free = MAX(stats->largest_free, GET_SIZE(HDRP(bp)));
+        }
+    }
+}
+
+/*
+ * mm_checkheap - 检查 heap 和两级链表
+ * 1. header 和 footer 匹配，不存在连续的 free block ，地址对齐
+ * 1. 链表中的 block 都是 free 的，所在的链表编号和 size 一致，pred/succ 连续
+ * 1. 位图和链表是否为空一致
+ * 1. 通过 header 得到的 free block 个数等于链表中的个数
+ */
+void mm_checkheap(int verbose)
+{
+    dbg_printf("call by line-%d\n", verbose);
+    (void)verbose;
+
+    char   *bp             = NEXT_BLKP(heap_listp);
+    size_t is_pre_alloc    = 1;
+    size_t free_block_num  = 0;
+
+    while (GET_SIZE(HDRP(bp)))
+    {
+        if (((size_t)bp % ALIGNMENT) != 0 ||
+            GET(HDRP(bp)) != GET(FTRP(bp)) ||
+            (!is_pre_alloc && !GET_ALLOC(HDRP(bp))))
+        {
+            dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+            exit(127);
+        }
+
+        is_pre_alloc = GET_ALLOC(HDRP(bp));
+        if (!is_pre_alloc)
+        {
+            free_block_num++;
+        }
+        bp = NEXT_BLKP(bp);
+    }
+
+    if (GET(HDRP(bp)) != 0x1 || bp > (char *)mem_heap_hi() + 1)
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        exit(127);
+    }
+
+    for (int fl = 0; fl < FL_INDEX_COUNT; fl++)
+    {
+        if (!(control->fl_bitmap & (1U << fl)) != (control->sl_bitmap[fl] == 0))
+        {
+            dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+            exit(127);
+        }
+
+        for (int sl = 0; sl < SL_INDEX_COUNT; sl++)
+        {
+            char *pred = NULL;
+            char *succ = control->blocks[fl][sl];
+
+            if (!(control->sl_bitmap[fl] & (1U << sl)) != (succ == NULL))
+            {
+                dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+                exit(127);
+            }
+
+            while (succ != NULL)
+            {
+                int f = 0, s = 0;
+                mapping_insert(GET_SIZE(HDRP(succ)), &f, &s);
+                if (f != fl || s != sl || PRED_BLKP(succ) != pred || GET_ALLOC(HDRP(succ)) ||
+                    succ < (char *)mem_heap_lo() || succ > (char *)mem_heap_hi())
+                {
+                    dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+                    exit(127);
+                }
+
+                free_block_num--;
+                pred = succ;
+                succ = SUCC_BLKP(succ);
+            }
+        }
+    }
+
+    if (free_block_num != 0)
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        exit(127);
+    }
+}
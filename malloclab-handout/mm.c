@@ -10,16 +10,86 @@
  * that describes what the function does.
  *
  * 整体设计：
- * 1. 每个 block 至少为 4 个指针大小，hdrp - pred - succ - ftrp ，依次为 头指针、前驱指针、后继指针、脚指针
- * 1. 分离空闲链表，有 9 个入口 {32}, {33-64}, {65-128}, {129-512}, {513-1024}, {1025-2048}, {2049-4096}, {4097-INC}
- * 1. 每个空闲链表入口包含两个指针，pred 和 succ ，用于消除头部的特殊处理
- * 1. 空闲链表的入口保存在堆的起始位置，使用一个全局变量保存首地址，供占据 2 * 9 * SIZE_T_SIZE 大小
- * 1. 为了保持 32 位兼容，堆空间上，空闲链表入口地址只有仍然保留一个 SIZE_T_SIZE 大小的对齐空间
+ * 1. 每个 block 至少为 4 个字（4 字节），hdrp - pred - succ - ftrp ，依次为 头部、前驱、后继、脚部
+ * 1. 整个堆在 memlib 的 MAX_HEAP (100 MB) 之内，header/footer 只需要 4 字节；pred 和 succ 保存相对堆起始位置的
+ *    32 位偏移，而不是 8 字节的指针，最小块从 32 字节减小到 16 字节
+ * 1. 只有 free block 有 footer ，已分配的 block 省略 footer ，header 的第 1 位保存前一个 block 是否已分配
+ * 1. 分离空闲链表，有 9 个入口 {16-32}, {33-64}, {65-128}, {129-512}, {513-1024}, {1025-2048}, {2049-4096}, {4097-INC}
+ * 1. 每个空闲链表入口包含两个偏移，pred 和 succ ，用于消除头部的特殊处理
+ * 1. 空闲链表的入口保存在堆的起始位置，使用一个全局变量保存首地址，第 0 项保留不用，偏移 0 表示 NULL
+ * 1. payload 需要 8 字节对齐，header 只有 4 字节，所以每个 block 的 header 都在 8k + 4 的位置，
+ *    block 的大小也都是 8 的倍数（动态库中是 16 ，见下）
  * 1. 单个空闲链表都按照 size 大小升序排列，使用 first_fit ，实现了 best_fit 的效果
+ * 1. 最后一组 {4097-INF} 不是链表，而是按 (size, 地址) 排序的 AVL 树，左右子树的偏移和高度保存在 payload 中，
+ *    树根保存在这一组入口的 succ 中，best fit 查找、插入和删除都是 O(log n)
+ * 1. 编译时定义 SIZE_CLASS_PROFILE 时（make mdriver-profile ），分组的个数、边界和 CHUNKSIZE 由 traces/profile.pl
+ *    统计 trace 的 size 分布后生成，见 mm-classes.h
+ *
+ * slab 前端（编译时定义 SLAB_FRONTEND 才启用，make mdriver-slab ）：
+ * 1. 不超过 256 字节的请求按 16 字节一组分为 16 组，由 slab 前端分配，不经过 find_fit 和 place
+ * 1. 每个 run 占一页，是从堆顶切出的一个 payload 按页对齐的 block ，run 的开始保存 run header ，之后是等大的 slot
+ * 1. 空闲的 slot 组成 run 内的单向链表，分配和释放都是链表头部操作，没有 boundary tag
+ * 1. 每组有一个双向链表，保存还有空闲 slot 的 run ，入口保存在分离空闲链表入口的后面
+ * 1. 页位图标记哪些页是 run ，free 的时候通过地址所在的页判断是 slab 还是后端的 block
+ * 1. 新的 run 从堆顶切出，不经过 find_fit ，brk 补齐到页边界之后每个 run 正好扩展一页
+ * 1. run 全部空闲时归还给后端
+ * 1. 一组没有 run 时先由后端分配，请求足够多才切出 run ，避免小 trace 每组都占一页
+ *
+ * 多线程（编译时定义 THREAD_SAFE 才启用，make mdriver-mt ）：
+ * 1. 原来的 malloc/free/realloc 改名为 heap_malloc/heap_free/heap_realloc ，只在持有 heap_lock 时调用
+ * 1. 每个线程有自己的缓存 tcache ，按 block 大小分组，每组是一个单向链表，最多缓存 TCACHE_COUNT 个 block
+ * 1. 缓存中的 block 对堆来说仍然是已分配的，malloc/free 命中缓存时不需要加锁
+ * 1. 线程退出时，通过 pthread_key 的析构函数把缓存的 block 还给堆
+ * 1. memlib 的堆可以分成多个 arena ，每个 arena 有自己的 brk 、空闲链表和锁，相当于多个独立的堆
+ * 1. 线程第一次分配时轮流绑定一个 arena ，只在这个 arena 中分配，空间不足时再尝试其他 arena
+ * 1. free 和 realloc 根据地址找到 block 所在的 arena ，加这个 arena 的锁
+ *
+ * 大的请求：
+ * 1. 不小于 MMAP_THRESHOLD 的 malloc 不经过堆，通过 mem_map 单独映射，free 时马上 mem_unmap
+ * 1. mapping 的开始空出 4 字节，之后是 header ，size 为 mapping 中可用的长度，并设置 IS_MMAPPED 位
+ * 1. realloc 后仍然很大时通过 mem_remap 调整，变小时复制到堆中
+ * 1. 堆中的 block 不会变成 mapping ，realloc 仍然在堆中处理
+ *
+ * 归还内存（编译时定义 HEAP_TRIM 才启用，make mdriver-trim ）：
+ * 1. free 合并后，堆末尾的空闲 block 超过 TRIM_THRESHOLD 时收缩 brk ，只保留 TRIM_PAD
+ * 1. 堆中间的空闲 block 超过 RELEASE_THRESHOLD 时，AVL 树节点和 footer 之间完整的页通过 mem_release 还给系统
+ * 1. 释放的页仍然在堆中，再次访问时内容为 0 ，block 的元数据都不在这些页中
+ * 1. mdriver 每次计时都重新开始 trace ，释放的页要重新缺页，吞吐量下降明显，所以默认不启用
+ * 1. slab 的 slot 不进入缓存，仍然加锁分配和释放
+ *
+ * 延迟合并（编译时定义 DEFERRED_COALESCE 才启用，make mdriver-deferred ）：
+ * 1. 不超过 FASTBIN_MAX_SIZE 的 block 释放时不合并，放入 arena 的快速 bin ，每 8 字节一组，是不排序的单向链表
+ * 1. 快速 bin 中的 block 对堆来说仍然是已分配的，链表保存在 payload 的前 4 字节，同样是相对堆起始位置的偏移
+ * 1. malloc 先从大小完全相同的快速 bin 中取，不经过 find_fit 和 place
+ * 1. 一组超过 FASTBIN_COUNT 个 block 时，把这一组全部合并；find_fit 找不到时，把所有快速 bin 合并后再查找一次
+ *
+ * 增量检查（编译时定义 HEAP_CHECK 才启用，make mdriver-check ）：
+ * 1. DEBUG 时每次操作都调用 arena_checkheap 遍历整个堆，大的 trace 基本跑不完
+ * 1. 每次 malloc/free/realloc 结束时，只对这次操作涉及的 block 做 O(1) 的局部检查：header 和 footer 一致，
+ *    前后的 block 已经合并，PREV_ALLOC 位正确，空闲链表或者 AVL 树中相邻节点的链接和顺序正确
+ * 1. 另外从 arena 的游标开始往后检查 CHECK_SLICE 个 block ，到结尾块后回到堆的开始，一段时间后覆盖整个堆
+ * 1. 游标总是指向 block 的起始位置，block 被合并到前面的 block 时，游标移到合并后的 block
+ * 1. 不检查 free block 的个数是否和空闲链表一致，这一项仍然需要 mm_checkheap
+ *
+ * 动态库（编译时定义 PRELOAD 和 THREAD_SAFE ，make libmm.so ）：
+ * 1. 不定义 DRIVER ，导出的就是 malloc/free/realloc/calloc ，通过 LD_PRELOAD 替换真实程序的分配器
+ * 1. 另外导出 posix_memalign/aligned_alloc/memalign/valloc/pvalloc 和 malloc_usable_size ，
+ *    否则程序通过这些函数拿到的 glibc 的 block 会被传给这里的 free
+ * 1. 第一次调用时通过 pthread_once 初始化：memlib 预留 MAX_HEAP 的虚拟地址空间，按 CPU 个数分成 arena
+ * 1. 对齐的请求在 arena 中由 alloc_aligned_block 分配，不经过线程缓存
+ * 1. fork 之前锁住所有 arena ，子进程中重新初始化锁，避免其他线程持有的锁在子进程中永远不释放
+ * 1. ALIGNMENT 为 16 ，和 glibc 一样保证 payload 16 字节对齐（long double 、SSE 类型），
+ *    block 的大小都是 16 的倍数，header 在 16k + 12 的位置，最小块仍然是 16 字节
+ *
+ * 统计：
+ * 1. 每个 arena 有一份 mm_stats_t 计数，持有 arena 的锁时直接加一，mm_stats 时再把所有 arena 加起来
+ * 1. malloc/free/realloc 的调用次数在加锁之前统计，多线程时用原子操作加到当前线程绑定的 arena 上，
+ *    每个线程一个 arena 时基本没有竞争
+ * 1. 每组空闲 block 的个数和字节数在插入、删除空闲链表时更新，不需要遍历堆
  *
  * 编码：
  * 1. 按照功能拆分了一些函数
- * 1. 使用了两个全局变量，一个保存空闲链表的入口地址，另一个保存序言块的起始地址（这个好像也不太需要。。）
+ * 1. 空闲链表的入口地址、序言块的起始地址和位图都保存在 arena_t 中，全局变量只有 arena 数组（单线程只用第 0 个）
  * 1. 涉及到指针的特殊处理，基本都使用了宏定义
  * 1. 函数头，对函数的注意事项进行了必要的描述
  *
@@ -37,10 +107,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#endif
+#ifdef PRELOAD
+#include <errno.h>
+#include <malloc.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
+#ifdef SIZE_CLASS_PROFILE
+/* traces/profile.pl 根据 trace 生成的分组和 CHUNKSIZE ，make mdriver-profile */
+#include "mm-classes.h"
+#endif
 
 /* If you want debugging output, use the following macro.  When you hand
  * in, remove the #define DEBUG line. */
@@ -61,40 +144,80 @@
 #define calloc mm_calloc
 #endif /* def DRIVER */
 
-/* single word (4) or double word (8) alignment */
+/* single word (4) or double word (8) alignment ，动态库和 glibc 一样 16 字节对齐 */
+#ifdef PRELOAD
+#define ALIGNMENT 16
+#else
 #define ALIGNMENT 8
+#endif
 /* expand heap by this amount (bytes) */
+#ifndef CHUNKSIZE
 #define CHUNKSIZE (1<<12)
+#endif
 /* rounds up to the nearest multiple of ALIGNMENT */
-#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
-/* hdr ftr pred succ -- size  自动适配 32 64 位系统 */
-#define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
+/* hdr ftr pred succ -- size ，都是 4 字节，32 64 位系统相同 */
+#define WSIZE (4)
 /* block 最小值 header footer pred succ */
-#define MIN_BLOCK_SIZE (8 + 8 + 8 + 8)
+#define MIN_BLOCK_SIZE (4 * WSIZE)
+/* header 中 size 只有 32 位，超过的请求直接失败 */
+#define MAX_REQUEST_SIZE (1UL << 31)
+#ifdef HEAP_TRIM
+/* 堆末尾的空闲 block 超过 TRIM_THRESHOLD 时收缩 brk ，只保留 TRIM_PAD */
+#define TRIM_THRESHOLD (128 * 1024)
+#define TRIM_PAD       (64 * 1024)
+/* 堆中间的空闲 block 超过 RELEASE_THRESHOLD 时，将其中完整的页还给系统 */
+#define RELEASE_THRESHOLD (256 * 1024)
+#endif
+#ifdef HEAP_CHECK
+/* 每次操作从游标开始检查的 block 个数 */
+#define CHECK_SLICE (8)
+#endif
+#ifdef DEFERRED_COALESCE
+/* 快速 bin 的参数，block 大小为 16, 24, ..., 128 ，每 ALIGNMENT 字节一组 */
+#define FASTBIN_MAX_SIZE (128)
+#define FASTBIN_NUM      ((FASTBIN_MAX_SIZE - MIN_BLOCK_SIZE) / ALIGNMENT + 1)
+#define FASTBIN_COUNT    (64)
+#define FASTBIN_INDEX(asize)  (((asize) - MIN_BLOCK_SIZE) / ALIGNMENT)
+#endif
 
-#define MAX(x, y) ((x) > (y) ? (x) : (y))
+/* 不小于 MMAP_THRESHOLD 的请求不在堆中分配，每个 block 单独使用 memlib 的一个 mapping */
+#define MMAP_THRESHOLD (128 * 1024)
+/* 单独映射的 block 中 payload 的偏移，前面是空出的字节和 header */
+#define MMAP_OFFSET    ALIGN(2 * WSIZE)
 
-#define SIZE_PTR(p)  ((size_t*)(((char*)(p)) - SIZE_T_SIZE))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
 
 /* pack size and allocated bit */
 #define PACK(size, alloc)  ((size) | (alloc))
 
+/* header 的第 1 位，前一个 block 是否已分配；已分配的 block 没有 footer ，只能通过这一位判断 */
+#define PREV_ALLOC (0x2)
+/* header 的第 2 位，block 是单独的 mapping ，不在堆中 */
+#define IS_MMAPPED (0x4)
+
 /* read and write -- at address p */
-#define GET(p)       (*(size_t *)(p))
-#define PUT(p, val)  (*(size_t *)(p) = val)
+#define GET(p)       (*(uint32_t *)(p))
+#define PUT(p, val)  (*(uint32_t *)(p) = (uint32_t)(val))
 
 /* read the size and allocated bit from address p */
 #define GET_SIZE(p)   (GET(p) & ~0x7)
 #define GET_ALLOC(p)  (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p)  (GET(p) & PREV_ALLOC)
+#define GET_MMAPPED(p)     (GET(p) & IS_MMAPPED)
 
-/* Given block ptr bp, computer address of its header and footer */
-#define HDRP(bp)  ((char *)(bp) - SIZE_T_SIZE)
-#define FTRP(bp)  ((char *)(bp) + GET_SIZE(HDRP(bp)) - 2 * SIZE_T_SIZE)
+/* Given block ptr bp, computer address of its header and footer -- 只有 free block 有 footer */
+#define HDRP(bp)  ((char *)(bp) - WSIZE)
+#define FTRP(bp)  ((char *)(bp) + GET_SIZE(HDRP(bp)) - 2 * WSIZE)
 
-/* Given block ptr bp, computer address of previous and next blocks */
-#define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE((char *)(bp) - 2 * SIZE_T_SIZE))
+/* Given block ptr bp, computer address of previous and next blocks -- PREV_BLKP 只在前一个 block 是 free 时有效 */
+#define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE((char *)(bp) - 2 * WSIZE))
 #define NEXT_BLKP(bp)  ((char *)(bp) + GET_SIZE(HDRP(bp)))
 
+/* 设置和清空 bp 的 header 中的 PREV_ALLOC 位，bp 可以是结尾块 */
+#define SET_PREV_ALLOC(bp)    PUT(HDRP(bp), GET(HDRP(bp)) | PREV_ALLOC)
+#define CLEAR_PREV_ALLOC(bp)  PUT(HDRP(bp), GET(HDRP(bp)) & ~PREV_ALLOC)
+
 /*
  * 定义空闲链表的前驱和后继的时候，发现有点迷茫
  * something about pointer:
@@ -106,13 +229,24 @@
  * 1. 变量名--同样也是内存中某个地址，类型--某种类型指针的指针，值--指向某种类型数据指针的地址
  * 1. 不管什么类型的指针， * 操作都是得到该指针指向的值
  */
+/*
+ * 空闲链表中保存的是相对 arena 起始位置（也就是 cur_arena->free_listp）的 32 位偏移
+ * 偏移 0 是保留的第 0 项，不会是任何 block 或者链表入口，用来表示 NULL
+ */
+#define OFFSET_TO_PTR(off)  ((off) ? (char *)cur_arena->free_listp + (off) : NULL)
+#define PTR_TO_OFFSET(p)    ((p) ? (uint32_t)((char *)(p) - (char *)cur_arena->free_listp) : 0)
+
 /* Given free block ptr bp, compute address of its preceding free block and succeeding block */
-#define PRED_BLKP(bp)  (*(char **)(bp))
-#define SUCC_BLKP(bp)  (*(char **)((char *)(bp) + SIZE_T_SIZE))
+#define PRED_BLKP(bp)  OFFSET_TO_PTR(GET(bp))
+#define SUCC_BLKP(bp)  OFFSET_TO_PTR(GET((char *)(bp) + WSIZE))
+
+/* 设置 free block 的前驱和后继 */
+#define SET_PRED(bp, p)  PUT(bp, PTR_TO_OFFSET(p))
+#define SET_SUCC(bp, p)  PUT((char *)(bp) + WSIZE, PTR_TO_OFFSET(p))
 
 
 /*
-  64 位系统，hdr + ftr + pred + succ = 8+ 8 + 8 + 8 = 32
+  hdr + ftr + pred + succ = 4 + 4 + 4 + 4 = 16
     16 - 32
     33 - 64
     65 - 128
@@ -122,376 +256,999 @@
   1025 - 2048
   2049 - 4096
   4097 - INF
-  共 9 组，每组保存 pred succ 两个指针
+  共 9 组，每组保存 pred succ 两个偏移，前面再保留一组不用（偏移 0 表示 NULL）
  */
+#ifndef SEGREGATED_FREE_LIST_NUM
 #define SEGREGATED_FREE_LIST_NUM        (9)
+#endif
 #define SEGREGATED_FREE_LIST_ENTRY_STEP (2)
 #define SEGREGATED_FREE_LIST_ENTRY_SIZE (SEGREGATED_FREE_LIST_NUM * SEGREGATED_FREE_LIST_ENTRY_STEP)
 
+/* 第 0 组的上限是 32 = 1 << 5 ，之后每组的上限翻倍 */
+#define SEGREGATED_FREE_LIST_MIN_SHIFT  (5)
+
+/* 第 index 组空闲链表的入口地址，跳过保留的第 0 项 */
+#define SEGREGATED_ENTRY(index) (cur_arena->free_listp + ((index) + 1) * SEGREGATED_FREE_LIST_ENTRY_STEP)
+
+/*
+ * 最后一组使用 AVL 树，节点是 free block 本身
+ * 1. payload 的前 3 个字依次是左子树、右子树的偏移和树的高度，左右子树和 pred succ 在相同的位置
+ * 1. 树根保存在入口的 succ 中，SUCC_BLKP(SEGREGATED_ENTRY(TREE_CLASS)) 仍然可以判断是否为空
+ */
+#define TREE_CLASS  (SEGREGATED_FREE_LIST_NUM - 1)
+#define TREE_ROOTP  (SEGREGATED_ENTRY(TREE_CLASS) + 1)
+#define TREE_ROOT   OFFSET_TO_PTR(*TREE_ROOTP)
+
+#define TREE_LEFT(bp)    OFFSET_TO_PTR(GET(bp))
+#define TREE_RIGHT(bp)   OFFSET_TO_PTR(GET((char *)(bp) + WSIZE))
+#define TREE_HEIGHT(bp)  ((bp) ? GET((char *)(bp) + 2 * WSIZE) : 0)
+
+#define SET_LEFT(bp, p)    PUT(bp, PTR_TO_OFFSET(p))
+#define SET_RIGHT(bp, p)   PUT((char *)(bp) + WSIZE, PTR_TO_OFFSET(p))
+#define SET_HEIGHT(bp, h)  PUT((char *)(bp) + 2 * WSIZE, h)
+
+/* 按 (size, 地址) 比较两个 block */
+#define TREE_LESS(a, b)  (GET_SIZE(HDRP(a)) < GET_SIZE(HDRP(b)) || \
+                          (GET_SIZE(HDRP(a)) == GET_SIZE(HDRP(b)) && (char *)(a) < (char *)(b)))
+
+/* 位图操作，第 index 位表示第 index 组空闲链表是否非空 */
+#define BITMAP_SET(index)    (cur_arena->free_bitmap |= (1UL << (index)))
+#define BITMAP_CLEAR(index)  (cur_arena->free_bitmap &= ~(1UL << (index)))
+#define BITMAP_TEST(index)   (cur_arena->free_bitmap & (1UL << (index)))
+
+#ifdef SLAB_FRONTEND
+/*
+ * slab 前端的参数
+ * 1. 每个 run 占一页，payload 按页对齐，block 大小正好一页，相邻的 run 可以首尾相接
+ * 1. run 的最后 4 字节是下一个 block 的 header ，不能保存 slot
+ */
+#define SLAB_RUN_SIZE     (1 << 12)
+#define SLAB_GRANULE      (16)
+#define SLAB_CLASS_NUM    (16)
+#define SLAB_MAX_SIZE     (SLAB_GRANULE * SLAB_CLASS_NUM)
+#define SLAB_HDR_SIZE     (ALIGN(sizeof(slab_run_t)))
+#define SLAB_PAYLOAD_END  (SLAB_RUN_SIZE - WSIZE)
+#define SLAB_PAGE_NUM     (MAX_HEAP / SLAB_RUN_SIZE)
+/* 一组没有 run 时先由后端分配，后端分配的次数达到 run 中 slot 个数的 SLAB_RUN_DEMAND 倍后才切出 run */
+#define SLAB_RUN_DEMAND   (4)
+
+/* 第 index 组的 slot 大小，以及一个 run 中 slot 的个数 */
+#define SLAB_SLOT_SIZE(index)  (((index) + 1) * SLAB_GRANULE)
+#define SLAB_SLOT_NUM(index)   ((SLAB_PAYLOAD_END - SLAB_HDR_SIZE) / SLAB_SLOT_SIZE(index))
+
+/* 地址 p 所在 run 的起始地址，以及相对堆起始位置的页号 */
+#define SLAB_RUNP(p)   ((slab_run_t *)((size_t)(p) & ~(size_t)(SLAB_RUN_SIZE - 1)))
+#define SLAB_PAGE(p)   ((size_t)((char *)(p) - (char *)mem_heap_lo()) / SLAB_RUN_SIZE)
+
+/* run header ，保存在 run 的起始位置 */
+typedef struct
+{
+    uint16_t class_index; /* 所在的组 */
+    uint16_t free_num;    /* 空闲 slot 的个数 */
+    uint32_t free_head;   /* 第一个空闲 slot 相对 run 的偏移，0 表示没有空闲 slot */
+    uint32_t pred;        /* 同一组中有空闲 slot 的 run 组成的双向链表，堆偏移，0 表示 NULL */
+    uint32_t succ;
+} slab_run_t;
+
+/* slab 链表入口的个数，保存在堆中 */
+#define SLAB_LIST_NUM     SLAB_CLASS_NUM
+#else
+#define SLAB_LIST_NUM     (0)
+#endif /* SLAB_FRONTEND */
+
+/* arena 开头的空闲链表入口和 slab 链表，都是 4 字节 */
+#define ARENA_ENTRY_WORDS (SEGREGATED_FREE_LIST_ENTRY_SIZE + SEGREGATED_FREE_LIST_ENTRY_STEP + SLAB_LIST_NUM)
+/* 对齐块的字数，使得入口、对齐块、序言块和第一个 block 的 header 之后的 payload 在 ALIGNMENT 的倍数上 */
+#define ARENA_PAD_WORDS   ((ALIGNMENT / WSIZE - (ARENA_ENTRY_WORDS + 3) % (ALIGNMENT / WSIZE)) % (ALIGNMENT / WSIZE))
+
+/*
+ * 一个 arena 是 memlib 中一段独立的堆，arena 的开始保存空闲链表入口，之后是序言块
+ * 不定义 THREAD_SAFE 时只使用第 0 个 arena
+ */
+typedef struct
+{
+    uint32_t *free_listp;   /* 分离空闲链表的入口，也是空闲链表中偏移的基址 */
+    char     *heap_listp;   /* 序言块 */
+    size_t   free_bitmap;   /* 非空空闲链表的位图，find_fit 不再需要逐个遍历空链表 */
+#ifdef SLAB_FRONTEND
+    uint32_t *slab_listp;   /* 每组 slab 链表的入口，保存在分离空闲链表入口的后面 */
+    uint32_t slab_demand[SLAB_CLASS_NUM]; /* 每组没有 run 时后端分配的次数 */
+#endif
+    int      index;         /* memlib 中 arena 的编号 */
+    mm_stats_t stats;       /* 统计计数，持有锁时更新 */
+#ifdef HEAP_CHECK
+    char     *check_cursor; /* 增量检查的游标，NULL 表示从堆的开始检查 */
+#endif
+#ifdef DEFERRED_COALESCE
+    uint32_t fastbins[FASTBIN_NUM];       /* 快速 bin 的链表头，堆偏移，0 表示 NULL */
+    uint32_t fastbin_counts[FASTBIN_NUM]; /* 每组快速 bin 中 block 的个数 */
+#endif
+#ifdef THREAD_SAFE
+    pthread_mutex_t lock;
+#endif
+} arena_t;
+
 // global variable
-static size_t *segregated_free_listp = NULL;
-static char   *heap_listp            = NULL;
+static arena_t arenas[MEM_ARENA_MAX];
+/* 单独映射的 block 的总字节数 */
+static size_t mmap_bytes;
+#ifdef SLAB_FRONTEND
+/* 页位图，标记哪些页是 run ，不能保存在 run 中（run 的起始位置可能是用户数据），所有 arena 共用 */
+static uint64_t slab_page_map[(SLAB_PAGE_NUM + 63) / 64];
+#endif
+
+#ifdef THREAD_SAFE
+/*
+ * 线程缓存的参数
+ * block 大小为 16, 24, ..., 512 ，每 ALIGNMENT 字节一组（动态库中为 16, 32, ..., 512 ）
+ */
+#define TCACHE_MAX_SIZE   (512)
+#define TCACHE_BIN_NUM    ((TCACHE_MAX_SIZE - MIN_BLOCK_SIZE) / ALIGNMENT + 1)
+#define TCACHE_COUNT      (16)
+#define TCACHE_INDEX(asize)  (((asize) - MIN_BLOCK_SIZE) / ALIGNMENT)
+
+/* 缓存的 block 通过 payload 的前 8 字节连接 */
+#define TCACHE_NEXT(bp)  (*(char **)(bp))
+
+typedef struct
+{
+    char     *bins[TCACHE_BIN_NUM];
+    uint32_t counts[TCACHE_BIN_NUM];
+} tcache_t;
+
+/* 线程退出时清空缓存 */
+static pthread_key_t   tcache_key;
+static pthread_once_t  tcache_key_once = PTHREAD_ONCE_INIT;
+static __thread tcache_t tcache;
+
+/* 当前线程正在操作的 arena ，持有它的锁时才能调用 heap_malloc/heap_free/heap_realloc */
+static __thread arena_t *cur_arena;
+/* 当前线程绑定的 arena ，第一次分配时按 next_arena 轮流选择 */
+static __thread arena_t *home_arena;
+static int next_arena;
+
+#define ARENA_NUM()         mem_arena_num()
+#define ARENA_SWITCH(arena) (cur_arena = (arena))
+#define ARENA_ENTER(arena)  (pthread_mutex_lock(&(arena)->lock), ARENA_SWITCH(arena))
+#define ARENA_LEAVE(arena)  pthread_mutex_unlock(&(arena)->lock)
+
+/* 不持有锁时更新计数 */
+#define STATS_ADD(var, n)   __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+#else
+/* 单线程只有一个 arena ，cur_arena 是常量，不需要额外的访存 */
+#define cur_arena           (&arenas[0])
+#define ARENA_NUM()         (1)
+#define ARENA_SWITCH(arena) ((void)(arena))
+#define ARENA_ENTER(arena)  ((void)(arena))
+#define ARENA_LEAVE(arena)  ((void)(arena))
+
+#define STATS_ADD(var, n)   ((var) += (n))
+#endif /* THREAD_SAFE */
+
+#ifdef PRELOAD
+#ifndef THREAD_SAFE
+#error "PRELOAD requires THREAD_SAFE"
+#endif
+/* 作为动态库时第一次调用 malloc 等函数才初始化堆 */
+static pthread_once_t preload_once = PTHREAD_ONCE_INIT;
+static int preload_ready;
+#define PRELOAD_INIT() \
+    (__atomic_load_n(&preload_ready, __ATOMIC_ACQUIRE) ? (void)0 : (void)pthread_once(&preload_once, preload_init))
+#else
+#define PRELOAD_INIT() ((void)0)
+#endif
 
 #define MEM_SUCCESS (0)
 #define MEM_ERROR   (-1)
 
 /* 内部函数声明 */
+static void *heap_malloc(size_t size);
+static void heap_free(void *ptr);
+static void *heap_realloc(void *oldptr, size_t size);
+static int arena_init(int index);
+static arena_t *thread_arena(void);
+static arena_t *ptr_to_arena(void *ptr);
+static void *arena_malloc(arena_t *arena, size_t size);
+static void arena_free(void *ptr);
+static void arena_checkheap(int lineno);
+#ifdef HEAP_CHECK
+static void arena_check_block(char *bp);
+static void arena_check_step(void *bp);
+#endif
+static void *mmap_malloc(size_t size);
+static void mmap_free(void *bp);
+static void *mmap_realloc(void *bp, size_t size);
+static inline int is_mmapped_ptr(void *ptr);
+static size_t adjust_size(size_t size);
 static void *extend_heap(size_t bytes);
 static void *coalesce(void *bp);
 static void *find_fit(size_t size);
 static void place(void *bp, size_t asize);
-static size_t *find_entry_in_segregated_list(size_t size);
+static void shrink_block(void *bp, size_t asize);
+#ifdef HEAP_TRIM
+static void release_free_block(void *bp);
+#endif
+static int grow_block(void *bp, size_t asize);
+#ifdef PRELOAD
+static void *alloc_aligned_block(size_t align, size_t asize);
+#endif
+#if defined(SLAB_FRONTEND) || defined(PRELOAD)
+static void *split_aligned_block(char *bp, char *abp, size_t asize);
+#endif
+#ifdef SLAB_FRONTEND
+static slab_run_t *slab_new_run(void);
+static void *slab_malloc(size_t size);
+static void slab_free(void *ptr);
+static inline int is_slab_ptr(void *ptr);
+static void slab_list_insert(slab_run_t *run);
+static void slab_list_delete(slab_run_t *run);
+static void slab_checkheap(void);
+#endif
+#ifdef THREAD_SAFE
+static void *tcache_get(size_t size);
+static int tcache_put(void *ptr);
+static void tcache_flush(void *arg);
+static void tcache_key_create(void);
+#endif
+#ifdef PRELOAD
+static void preload_init(void);
+static void preload_fork_prepare(void);
+static void preload_fork_parent(void);
+static void preload_fork_child(void);
+#endif
+#ifdef DEFERRED_COALESCE
+static void *fastbin_get(size_t asize);
+static int fastbin_put(void *bp);
+static size_t fastbin_flush(size_t index);
+static size_t fastbin_consolidate(void);
+static void fastbin_checkheap(void);
+#endif
+static inline size_t size_to_class(size_t size);
+#ifdef SIZE_CLASS_PROFILE
+static int class_contains(size_t index, size_t size);
+#endif
+static uint32_t *find_entry_in_segregated_list(size_t size);
 static int insert_to_segregated_list(void *bp);
 static int delete_from_segregated_list(void *bp);
+static char *tree_insert(char *root, char *bp);
+static char *tree_delete(char *root, char *bp);
+static char *tree_delete_min(char *root, char **min);
+static char *tree_balance(char *bp);
+static char *tree_find_fit(size_t asize);
+static size_t arena_largest_free(void);
+static size_t tree_checkheap(char *bp, char **prev, size_t *height);
 static void mm_print_heap();
 
 /*
  * mm_init - Called when a new trace starts.
  * 作用：
- * 1. 初始化空闲链表
- * 1. 是否需要额外的空间对齐 -- 64 位始终不需要，32 位需要关注分离空闲链表的个数
+ * 1. 清空页位图，调用 arena_init 初始化每个 arena
+ * 1. 多线程时，只能在没有其他线程使用堆的时候调用，当前线程的缓存清空，重新绑定 arena
+ */
+int mm_init(void)
+{
+#ifdef THREAD_SAFE
+    memset(&tcache, 0, sizeof(tcache));
+    home_arena = NULL;
+    next_arena = 0;
+#endif
+#ifdef SLAB_FRONTEND
+    memset(slab_page_map, 0, sizeof(slab_page_map));
+#endif
+    mmap_bytes = 0;
+
+    for (int index = 0; index < ARENA_NUM(); index++)
+    {
+        if (arena_init(index) == MEM_ERROR)
+        {
+            return MEM_ERROR;
+        }
+    }
+
+#ifdef DEBUG
+    mm_checkheap(__LINE__);
+#endif
+    return 0;
+}
+
+/*
+ * 初始化第 index 个 arena
+ * 1. 初始化空闲链表和 slab 链表
+ * 1. 需要额外的空间对齐 -- 第一个 block 的 payload 在 ALIGNMENT 的倍数上，header 在它前面 4 字节
  * 1. 初始化序言块和结尾块
  * 1. 申请一定大小的空间，调用 extend_heap 函数实现
  */
-int mm_init(void)
+static int arena_init(int index)
 {
-    // 2 * 9 ，前面是偶数个，32 位的时候，仍然需要保留一个 SIZE_T_SIZE 对齐
-    heap_listp = (char *)mem_sbrk((SEGREGATED_FREE_LIST_ENTRY_SIZE + 4) * SIZE_T_SIZE);
-    if ((void *)heap_listp == (void *)MEM_ERROR)
+    ARENA_SWITCH(&arenas[index]);
+    cur_arena->index = index;
+    memset(&cur_arena->stats, 0, sizeof(cur_arena->stats));
+#ifdef HEAP_CHECK
+    cur_arena->check_cursor = NULL;
+#endif
+#ifdef THREAD_SAFE
+    pthread_mutex_init(&cur_arena->lock, NULL);
+#endif
+
+    // 保留的一项 + 2 * 9 + slab 链表，都是 4 字节，再加上对齐块、序言块和结尾块
+    cur_arena->heap_listp = (char *)mem_arena_sbrk(index, (ARENA_ENTRY_WORDS + ARENA_PAD_WORDS + 3) * WSIZE);
+    if ((void *)cur_arena->heap_listp == (void *)MEM_ERROR)
     {
         return MEM_ERROR;
     }
 
     // 堆的开始位置保存空闲链表数组
-    segregated_free_listp = (size_t *)heap_listp;
+    cur_arena->free_listp = (uint32_t *)cur_arena->heap_listp;
     // 初始化空闲链表全部为空
-    memset(segregated_free_listp, 0, SEGREGATED_FREE_LIST_ENTRY_SIZE * SIZE_T_SIZE);
+    memset(cur_arena->free_listp, 0, (SEGREGATED_FREE_LIST_ENTRY_SIZE + SEGREGATED_FREE_LIST_ENTRY_STEP) * WSIZE);
+    cur_arena->free_bitmap = 0;
+#ifdef DEFERRED_COALESCE
+    memset(cur_arena->fastbins, 0, sizeof(cur_arena->fastbins));
+    memset(cur_arena->fastbin_counts, 0, sizeof(cur_arena->fastbin_counts));
+#endif
+
+#ifdef SLAB_FRONTEND
+    // 空闲链表数组后面是 slab 链表数组
+    cur_arena->slab_listp = SEGREGATED_ENTRY(SEGREGATED_FREE_LIST_NUM);
+    memset(cur_arena->slab_listp, 0, SLAB_LIST_NUM * WSIZE);
+    memset(cur_arena->slab_demand, 0, sizeof(cur_arena->slab_demand));
+#endif
 
-    // heap_listp 跳过空闲链表数组
-    heap_listp += SEGREGATED_FREE_LIST_ENTRY_SIZE * SIZE_T_SIZE;
+    // cur_arena->heap_listp 跳过空闲链表数组和 slab 链表数组
+    cur_arena->heap_listp = (char *)(SEGREGATED_ENTRY(SEGREGATED_FREE_LIST_NUM) + SLAB_LIST_NUM);
     // 初始化序言块 prologue block 和结尾块 epilogue block
-    PUT(heap_listp, 0); /* 32 位的时候，需要的对齐块 */
-    PUT(heap_listp + 1 * SIZE_T_SIZE, PACK(2 * SIZE_T_SIZE, 1)); /* prologue header */
-    PUT(heap_listp + 2 * SIZE_T_SIZE, PACK(2 * SIZE_T_SIZE, 1)); /* prologue footer */
-    PUT(heap_listp + 3 * SIZE_T_SIZE, PACK(0, 1)); /* epilogue header */
+    memset(cur_arena->heap_listp, 0, ARENA_PAD_WORDS * WSIZE); /* 对齐块，使得 payload 在 ALIGNMENT 的倍数上 */
+    cur_arena->heap_listp += ARENA_PAD_WORDS * WSIZE;
+    PUT(cur_arena->heap_listp, PACK(2 * WSIZE, 1)); /* prologue header */
+    PUT(cur_arena->heap_listp + 1 * WSIZE, PACK(2 * WSIZE, 1)); /* prologue footer */
+    PUT(cur_arena->heap_listp + 2 * WSIZE, PACK(0, PREV_ALLOC | 1)); /* epilogue header */
 
     // 指向序言块的中间
-    heap_listp += 2 * SIZE_T_SIZE;
+    cur_arena->heap_listp += WSIZE;
 
     // 扩张块
     if (extend_heap(CHUNKSIZE) == NULL)
     {
-        return -1;
+        return MEM_ERROR;
     }
 
-#ifdef DEBUG
-    mm_checkheap(__LINE__);
-#endif
-    return 0;
+    return MEM_SUCCESS;
 }
 
 /*
  * malloc - Allocate a block
- *      Always allocate a block whose size is a multiple of the alignment.
  *
- * 1. 调整 size ，满足对齐和最小块的要求（请求的大小需要先加上 header 和 footer 大小）
- * 1. 调用 find_fit 搜索合适的 block
- * 1. 如果找到，调用 place
- * 1. 无论是否找到，都返回 bp （未找到时， bp = NULL）
+ * 1. 大的请求单独映射
+ * 1. 先从线程缓存中查找，找不到再到当前线程绑定的 arena 中分配
+ * 1. 绑定的 arena 空间不足时，依次尝试其他 arena
  */
 void *malloc(size_t size)
 {
-    if (size == 0)
-    {
-        return NULL;
-    }
+    PRELOAD_INIT();
+#ifdef PRELOAD
+    // 真实的程序常把 malloc(0) 返回 NULL 当作内存不足，和 glibc 一样返回一个最小块
+    size = MAX(size, 1);
+#endif
 
-    /* adjusted block size */
-    size_t asize = 0;
-    void   *bp   = NULL;
+    arena_t *arena = thread_arena();
+    STATS_ADD(arena->stats.malloc_calls, 1);
 
-    // 满足最小块的要求
-    if (size <= SIZE_T_SIZE)
+    if (size >= MMAP_THRESHOLD && size < MAX_REQUEST_SIZE)
     {
-        asize = MIN_BLOCK_SIZE;
+        return mmap_malloc(size);
     }
-    else
+
+#ifdef THREAD_SAFE
+    void *ptr = tcache_get(size);
+    if (ptr != NULL)
     {
-        asize = ALIGN(size + 2 * SIZE_T_SIZE);
+        return ptr;
     }
+#endif
 
-    // 查找合适的 block ，此处不关心具体实现算法
-    // 如果空闲链表中没有合适的 block ，find_fit 会扩张堆的大小
-    bp = find_fit(asize);
-
-    // 如果找到了合适的 block
-    if (bp != NULL)
+    void *bp = arena_malloc(arena, size);
+    for (int i = 1; bp == NULL && size != 0 && i < ARENA_NUM(); i++)
     {
-        place(bp, asize);
-        dbg_printf("malloc size %lu, asize %lu => %p\n", size, asize, bp);
+        bp = arena_malloc(&arenas[(arena->index + i) % ARENA_NUM()], size);
     }
 
-#ifdef DEBUG
-    mm_checkheap(__LINE__);
-#endif
-    // 没有找到合适的 block ，bp = NULL
     return bp;
 }
 
 /*
  * free - 释放之前分配的 block
  *
- * 1. 主要需要清空 allocated bit ，合并，加入空闲链表
- * 1. 这里只需要调用 coalesce 函数即可
+ * 1. 先放入线程缓存，缓存已满或者不能缓存时再由 block 所在的 arena 释放
  */
-void free(void *ptr){
-    if (ptr != NULL)
+void free(void *ptr)
+{
+    PRELOAD_INIT();
+    STATS_ADD(thread_arena()->stats.free_calls, 1);
+
+#ifdef THREAD_SAFE
+    if (tcache_put(ptr) == MEM_SUCCESS)
     {
-        dbg_printf("free size %lu => %p\n", GET_SIZE(HDRP(ptr)), ptr);
-        // 不需要设置 header 和 footer ，直接调用合并函数就可以了
-        coalesce(ptr);
-#ifdef DEBUG
-        mm_checkheap(__LINE__);
-#endif
+        return;
     }
+#endif
+
+    arena_free(ptr);
 }
 
 /*
- * realloc - Change the size of the block by mallocing a new block,
- *      copying its data, and freeing the old block.  I'm too lazy
- *      to do better.
- * TODO - 暂未处理
+ * realloc - 在 block 所在的 arena 中由 heap_realloc 处理，不经过线程缓存
+ *
+ * 1. 单独映射的 block 由 mmap_realloc 处理
  */
 void *realloc(void *oldptr, size_t size)
 {
-  size_t oldsize;
-  void *newptr;
-
-  /* If size == 0 then this is just free, and we return NULL. */
-  if(size == 0) {
-    free(oldptr);
-    return 0;
-  }
-
-  /* If oldptr is NULL, then this is just malloc. */
-  if(oldptr == NULL) {
-    return malloc(size);
-  }
+    PRELOAD_INIT();
+    STATS_ADD(thread_arena()->stats.realloc_calls, 1);
 
-  newptr = malloc(size);
+    if (oldptr != NULL && is_mmapped_ptr(oldptr))
+    {
+        return mmap_realloc(oldptr, size);
+    }
 
-  /* If realloc() fails the original block is left untouched  */
-  if(!newptr) {
-    return 0;
-  }
+    arena_t *arena = (oldptr == NULL) ? thread_arena() : ptr_to_arena(oldptr);
 
-  /* Copy the old data. */
-  oldsize = *SIZE_PTR(oldptr);
-  if(size < oldsize) oldsize = size;
-  memcpy(newptr, oldptr, oldsize);
+    ARENA_ENTER(arena);
+    void *newptr = heap_realloc(oldptr, size);
+    ARENA_LEAVE(arena);
 
-  /* Free the old block. */
-  free(oldptr);
+    return newptr;
+}
 
-  return newptr;
+/*
+ * 当前线程绑定的 arena
+ */
+static arena_t *thread_arena(void)
+{
+#ifdef THREAD_SAFE
+    if (home_arena == NULL)
+    {
+        home_arena = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % ARENA_NUM()];
+    }
+    return home_arena;
+#else
+    return &arenas[0];
+#endif
 }
 
 /*
- * calloc - Allocate the block and set it to zero.
+ * block 所在的 arena
  */
-void *calloc (size_t nmemb, size_t size)
+static arena_t *ptr_to_arena(void *ptr)
 {
-  size_t bytes = nmemb * size;
-  void *newptr;
+#ifdef THREAD_SAFE
+    return &arenas[mem_arena_index(ptr)];
+#else
+    (void)ptr;
+    return &arenas[0];
+#endif
+}
 
-  newptr = malloc(bytes);
-  memset(newptr, 0, bytes);
+/*
+ * 加 arena 的锁，在 arena 中分配
+ */
+static void *arena_malloc(arena_t *arena, size_t size)
+{
+    ARENA_ENTER(arena);
+    void *bp = heap_malloc(size);
+    ARENA_LEAVE(arena);
 
-  return newptr;
+    return bp;
 }
 
 /*
- * 堆空间无法继续分配需要的空间，通过系统调用扩展堆的大小
- * 只在两个地方调用：初始化和 find_fit (not malloc)
- *
- * 作用：
- * 1. 保证扩展的 block 大小符合对齐要求
- * 1. 初始化新 block 的头部（占用了原来结尾块的空间）和脚部
- * 1. 设置新的结尾块
- * 1. 前面 block 可能是 free 的，需要合并块，不需要显著将合并后的 block 加入空闲链表，coalesce 函数中会处理
+ * 加 block 所在 arena 的锁，释放 block
+ * 1. 单独映射的 block 不在任何 arena 中，直接 mmap_free
  */
-static void *extend_heap(size_t bytes)
+static void arena_free(void *ptr)
 {
-    char   *bp   = NULL;
-    size_t asize = 0;
+    if (ptr == NULL)
+    {
+        return;
+    }
 
-    if (bytes < MIN_BLOCK_SIZE)
+    if (is_mmapped_ptr(ptr))
     {
-        asize = MIN_BLOCK_SIZE;
+        mmap_free(ptr);
+        return;
     }
-    else
+
+    arena_t *arena = ptr_to_arena(ptr);
+    ARENA_ENTER(arena);
+    heap_free(ptr);
+    ARENA_LEAVE(arena);
+}
+
+/*
+ * 是否是单独映射的 block
+ * 1. slab 的 slot 没有 header ，前 4 字节是其他 slot 的数据，要先排除 slot 再读 IS_MMAPPED 位
+ */
+static inline int is_mmapped_ptr(void *ptr)
+{
+#ifdef SLAB_FRONTEND
+    if (is_slab_ptr(ptr))
     {
-        asize = ALIGN(bytes);
+        return 0;
     }
+#endif
+    return GET_MMAPPED(HDRP(ptr));
+}
 
-    // 分配的大小满足对齐要求
-    bp = (char *)mem_sbrk(asize);
-    if ((void *)bp == (void *)MEM_ERROR)
+/*
+ * 单独映射一个 block ，不需要加锁
+ * 1. mem_map 返回的地址 16 字节对齐，payload 在 MMAP_OFFSET 处，header 在它前面 4 字节
+ */
+static void *mmap_malloc(size_t size)
+{
+    size_t len = ALIGN(size + MMAP_OFFSET);
+    char   *p  = (char *)mem_map(len);
+    if ((void *)p == (void *)MEM_ERROR)
     {
         return NULL;
     }
 
-    // 初始化新的空闲块 header footer
-    PUT(HDRP(bp), PACK(asize, 0));
-    PUT(FTRP(bp), PACK(asize, 0));
-    // 设置尾块
-    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
+    PUT(p + MMAP_OFFSET - WSIZE, PACK(len, IS_MMAPPED | 0x1));
+    STATS_ADD(mmap_bytes, len);
+    dbg_printf("mmap size %lu => %p\n", size, p + MMAP_OFFSET);
+    return p + MMAP_OFFSET;
+}
 
-    // 前面的块可能是 free block ，coalesce 会将新申请的 block 加入分离空闲链表
-    return coalesce(bp);
+static void mmap_free(void *bp)
+{
+    dbg_printf("munmap => %p\n", bp);
+    STATS_ADD(mmap_bytes, -(size_t)GET_SIZE(HDRP(bp)));
+    mem_unmap((char *)bp - MMAP_OFFSET);
 }
 
 /*
- * 如果空闲 block 地址紧邻的前后 block 是 free 的，需要合并块
- * 不会出现前面或者后面连续的 block （否则之前的状态有问题），就是说合并操作不需要递归或者循环
- *
- * 作用：
- * 1. 处理四种情况下的合并： 前 A 后 A 、前 A 后 F 、前 F 后 A 、前 F 后 F
- * 1. 如果前后或后面的块有是 free 状态的，需要将其从分离空闲链表摘除
- * 1. 合并 block ，先计算 size ，必须先设置合并后地址的 header ，然后设置 footer
- * 1. 合并后的空闲链表，加入分离空闲链表中
- * 1. 返回值是合并后的 free block 的地址，如果前面 block 是 free 的，那么返回值是前面 block 的地址
+ * 调整单独映射的 block
+ * 1. size 为 0 时释放
+ * 1. 仍然不小于 MMAP_THRESHOLD 时 mem_remap ，可能移动，失败时原来的 block 不变
+ * 1. 变小后由 malloc 在堆中分配，复制后释放原来的 mapping
  */
-
-static void *coalesce(void *bp)
+static void *mmap_realloc(void *bp, size_t size)
 {
-    char   *prev      = PREV_BLKP(bp);
-    char   *next      = NEXT_BLKP(bp);
-    // 因为有序言块和结尾块，这里不需要额外的判断
-    size_t prev_alloc = GET_ALLOC(HDRP(prev));
-    size_t next_alloc = GET_ALLOC(HDRP(next));
-    size_t size       = GET_SIZE(HDRP(bp));
-
-    // 前 A 后 A
-    if (prev_alloc && next_alloc)
+    if (size == 0)
     {
-        // 直接加入到分离空闲链表就可以了
-        insert_to_segregated_list(bp);
+        mmap_free(bp);
+        return NULL;
     }
 
-    // 前 A 后 F
-    else if (prev_alloc && !next_alloc)
+    if (size >= MAX_REQUEST_SIZE)
     {
-        // 将 next free block 从空闲链表删除
-        delete_from_segregated_list(next);
-        // 合并后新 block 的 size
-        size += GET_SIZE(HDRP(next));
-        // 设置合并后 block 的 header 和 footer
-        PUT(HDRP(bp), PACK(size, 0x0));
-        PUT(FTRP(bp), PACK(size, 0x0));
-        // 插入空闲链表
-        insert_to_segregated_list(bp);
+        return NULL;
     }
 
-    // 前 F 后 A
-    else if (!prev_alloc && next_alloc)
+    if (size >= MMAP_THRESHOLD)
     {
-        // 将 prev free block 从空闲链表删除
-        delete_from_segregated_list(prev);
-        // 合并后新 block 的 size
-        size += GET_SIZE(HDRP(prev));
-        // 合并后的 block 是前面 block 的地址
-        bp = prev;
-        // 设置合并后 block 的 header 和 footer
-        PUT(HDRP(bp), PACK(size, 0x0));
-        PUT(FTRP(bp), PACK(size, 0x0));
-        // 插入空闲链表
-        insert_to_segregated_list(bp);
+        size_t old_len = GET_SIZE(HDRP(bp));
+        size_t len     = ALIGN(size + MMAP_OFFSET);
+        char   *p      = (char *)mem_remap((char *)bp - MMAP_OFFSET, len);
+        if ((void *)p == (void *)MEM_ERROR)
+        {
+            return NULL;
+        }
+
+        PUT(p + MMAP_OFFSET - WSIZE, PACK(len, IS_MMAPPED | 0x1));
+        STATS_ADD(mmap_bytes, len - old_len);
+        return p + MMAP_OFFSET;
     }
 
-    // 前 A 后 A
-    else
+    void *newptr = malloc(size);
+    if (newptr != NULL)
     {
-        // 将 prev 和 next free block 从空闲链表删除
-        delete_from_segregated_list(prev);
-        delete_from_segregated_list(next);
-        // 合并后新 block 的 size
-        size += GET_SIZE(HDRP(prev)) + GET_SIZE(HDRP(next));
-        // 合并后的 block 是前面 block 的地址
-        bp = prev;
-        // 设置合并后 block 的 header 和 footer
-        PUT(HDRP(bp), PACK(size, 0x0));
-        PUT(FTRP(bp), PACK(size, 0x0));
-        // 插入空闲链表
-        insert_to_segregated_list(bp);
+        memcpy(newptr, bp, size);
+        mmap_free(bp);
     }
 
-#ifdef DEBUG
-    mm_checkheap(__LINE__);
-#endif
-    return bp;
+    return newptr;
 }
 
 /*
- * 分离空闲链表的入口，如果只使用一个指针，开头都需要做特殊处理
- * 因此使用空间换取时间的方法，每个入口（头节点）使用两个指针的空间，
- * 分别保存 perd 和 succ 两个指针，和正常的空闲块一样（这样在链表头节点不再需要特殊处理）
- * 但是头节点并没有 header 和 footer 空间，不可以在头节点获取块的大小，头节点默认块大小为 0
- */
-
-/*
- * 查找对应的分离空闲链表入口
- * 作用：
- * 1. 根据 size 的大小，返回对应链表的起始地址
+ * heap_malloc - Allocate a block
+ *      Always allocate a block whose size is a multiple of the alignment.
+ *
+ * 1. 小的请求由 slab 前端分配，失败时（堆空间不足以再分配一个 run）再由后端分配
+ * 1. 调整 size ，满足对齐和最小块的要求（请求的大小需要先加上 header 和 footer 大小）
+ * 1. 调用 find_fit 搜索合适的 block
+ * 1. 如果找到，调用 place
+ * 1. 无论是否找到，都返回 bp （未找到时， bp = NULL）
+ */
+static void *heap_malloc(size_t size)
+{
+    if (size == 0 || size >= MAX_REQUEST_SIZE)
+    {
+        return NULL;
+    }
+
+#ifdef SLAB_FRONTEND
+    if (size <= SLAB_MAX_SIZE)
+    {
+        void *ptr = slab_malloc(size);
+        if (ptr != NULL)
+        {
+            return ptr;
+        }
+    }
+#endif
+
+    /* adjusted block size */
+    size_t asize = adjust_size(size);
+    void   *bp   = NULL;
+
+#ifdef DEFERRED_COALESCE
+    // 快速 bin 中的 block 大小正好是 asize ，已经是分配状态
+    bp = fastbin_get(asize);
+    if (bp != NULL)
+    {
+        dbg_printf("malloc size %lu, asize %lu => %p (fastbin)\n", size, asize, bp);
+#ifdef HEAP_CHECK
+        arena_check_step(bp);
+#endif
+        return bp;
+    }
+#endif
+
+    // 查找合适的 block ，此处不关心具体实现算法
+    // 如果空闲链表中没有合适的 block ，find_fit 会扩张堆的大小
+    bp = find_fit(asize);
+
+    // 如果找到了合适的 block
+    if (bp != NULL)
+    {
+        place(bp, asize);
+        dbg_printf("malloc size %lu, asize %lu => %p\n", size, asize, bp);
+    }
+
+#ifdef DEBUG
+    arena_checkheap(__LINE__);
+#endif
+#ifdef HEAP_CHECK
+    arena_check_step(bp);
+#endif
+    // 没有找到合适的 block ，bp = NULL
+    return bp;
+}
+
+/*
+ * heap_free - 释放之前分配的 block
+ *
+ * 1. slab 分配的 slot 交给 slab_free 处理
+ * 1. 主要需要清空 allocated bit ，合并，加入空闲链表
+ * 1. 这里只需要调用 coalesce 函数即可
+ * 1. 定义 HEAP_TRIM 时，合并后的 block 很大，调用 release_free_block 归还内存
+ * 1. 定义 DEFERRED_COALESCE 时，小的 block 先放入快速 bin ，不合并
+ */
+static void heap_free(void *ptr)
+{
+#ifdef SLAB_FRONTEND
+    if (ptr != NULL && is_slab_ptr(ptr))
+    {
+        slab_free(ptr);
+        return;
+    }
+#endif
+    if (ptr != NULL)
+    {
+        dbg_printf("free size %lu => %p\n", GET_SIZE(HDRP(ptr)), ptr);
+#ifdef DEFERRED_COALESCE
+        if (fastbin_put(ptr) == MEM_SUCCESS)
+        {
+#ifdef DEBUG
+            arena_checkheap(__LINE__);
+#endif
+#ifdef HEAP_CHECK
+            arena_check_step(ptr);
+#endif
+            return;
+        }
+#endif
+        // 不需要设置 header 和 footer ，直接调用合并函数就可以了
+        ptr = coalesce(ptr);
+#ifdef HEAP_TRIM
+        release_free_block(ptr);
+#endif
+#ifdef DEBUG
+        arena_checkheap(__LINE__);
+#endif
+#ifdef HEAP_CHECK
+        arena_check_step(ptr);
+#endif
+    }
+}
+
+/*
+ * heap_realloc - 尽量原地调整 block 的大小，只有无法原地调整时才 malloc - copy - free
  *
- * 这里这么的 if 效率肯定会特别的低，待优化 TODO
- * 也可以根据需要修改这个函数的实现，不影响其他的功能
+ * 1. size 为 0 相当于 free ，oldptr 为 NULL 相当于 malloc
+ * 1. slab 的 slot 不能原地调整，新的 size 不超过 slot 大小时直接返回，否则 malloc - copy - free
+ * 1. 缩小：原地分割，剩余部分合并后加入空闲链表
+ * 1. 扩大：后面的 block 是 free 的，或者当前 block 在堆的最后（后面是结尾块），原地合并
+ * 1. 以上都不满足时，才 malloc 新的 block ，拷贝数据，释放旧的 block
  */
-static size_t *find_entry_in_segregated_list(size_t size)
+static void *heap_realloc(void *oldptr, size_t size)
 {
-    if (size <= 32)
+    /* If size == 0 then this is just free, and we return NULL. */
+    if (size == 0)
     {
-        return segregated_free_listp;
+        heap_free(oldptr);
+        return NULL;
     }
-    else if (size <= 64)
+
+    /* If oldptr is NULL, then this is just malloc. */
+    if (oldptr == NULL)
     {
-        return segregated_free_listp + 1 * 2;
+        return heap_malloc(size);
     }
-    else if (size <= 128)
+
+    if (size >= MAX_REQUEST_SIZE)
     {
-        return segregated_free_listp + 2 * 2;
+        return NULL;
     }
-    else if (size <= 256)
+
+#ifdef SLAB_FRONTEND
+    if (is_slab_ptr(oldptr))
     {
-        return segregated_free_listp + 3 * 2;
+        size_t slot_size = SLAB_SLOT_SIZE(SLAB_RUNP(oldptr)->class_index);
+        if (size <= slot_size)
+        {
+            return oldptr;
+        }
+
+        void *newptr = heap_malloc(size);
+        if (newptr != NULL)
+        {
+            memcpy(newptr, oldptr, slot_size);
+            slab_free(oldptr);
+        }
+        return newptr;
     }
-    else if (size <= 512)
+#endif
+
+    size_t asize   = adjust_size(size);
+    size_t oldsize = GET_SIZE(HDRP(oldptr));
+
+    // 原地缩小，或者 size 变化不大，block 本身就可以满足
+    if (asize <= oldsize)
     {
-        return segregated_free_listp + 4 * 2;
+        shrink_block(oldptr, asize);
+        dbg_printf("realloc shrink %p to %lu\n", oldptr, asize);
+#ifdef HEAP_CHECK
+        arena_check_step(oldptr);
+#endif
+        return oldptr;
     }
-    else if (size <= 1024)
+
+    // 原地扩大
+    if (grow_block(oldptr, asize) == MEM_SUCCESS)
     {
-        return segregated_free_listp + 5 * 2;
+        dbg_printf("realloc grow %p to %lu\n", oldptr, asize);
+#ifdef HEAP_CHECK
+        arena_check_step(oldptr);
+#endif
+        return oldptr;
     }
-    else if (size <= 2048)
+
+    void *newptr = heap_malloc(size);
+    /* If realloc() fails the original block is left untouched  */
+    if (newptr == NULL)
     {
-        return segregated_free_listp + 6 * 2;
+        return NULL;
     }
-    else if (size <= 4096)
+
+    /* Copy the old data. */
+    memcpy(newptr, oldptr, oldsize - WSIZE);
+
+    /* Free the old block. */
+    heap_free(oldptr);
+
+    return newptr;
+}
+
+/*
+ * calloc - Allocate the block and set it to zero.
+ * nmemb * size 溢出或者分配失败时返回 NULL
+ */
+void *calloc (size_t nmemb, size_t size)
+{
+  size_t bytes = nmemb * size;
+  void *newptr;
+
+  if (nmemb != 0 && bytes / nmemb != size)
+    return NULL;
+
+  newptr = malloc(bytes);
+  if (newptr != NULL)
+    memset(newptr, 0, bytes);
+
+  return newptr;
+}
+
+/*
+ * 根据请求的 size 计算 block 的大小
+ * 1. 已分配的 block 没有 footer ，只需要加上 header 的大小，满足对齐的要求
+ * 1. 满足最小块的要求，释放后需要保存 pred succ 和 footer
+ */
+static size_t adjust_size(size_t size)
+{
+    return MAX(ALIGN(size + WSIZE), MIN_BLOCK_SIZE);
+}
+
+/*
+ * 堆空间无法继续分配需要的空间，通过系统调用扩展堆的大小
+ * 只在三个地方调用：初始化、find_fit (not malloc) 和 grow_block
+ *
+ * 作用：
+ * 1. 保证扩展的 block 大小符合对齐要求，超过 INT_MAX 时返回 NULL
+ * 1. 初始化新 block 的头部（占用了原来结尾块的空间）和脚部
+ * 1. 设置新的结尾块
+ * 1. 前面 block 可能是 free 的，需要合并块，不需要显著将合并后的 block 加入空闲链表，coalesce 函数中会处理
+ */
+static void *extend_heap(size_t bytes)
+{
+    char   *bp   = NULL;
+    size_t asize = 0;
+
+    if (bytes < MIN_BLOCK_SIZE)
     {
-        return segregated_free_listp + 7 * 2;
+        asize = MIN_BLOCK_SIZE;
     }
     else
     {
-        return segregated_free_listp + 8 * 2;
+        asize = ALIGN(bytes);
+    }
+
+    // mem_arena_sbrk 的参数是 int ，超过 INT_MAX 会变成负数
+    if (asize > INT_MAX)
+    {
+        return NULL;
+    }
+
+    // 分配的大小满足对齐要求
+    bp = (char *)mem_arena_sbrk(cur_arena->index, asize);
+    if ((void *)bp == (void *)MEM_ERROR)
+    {
+        return NULL;
+    }
+    cur_arena->stats.extend_calls++;
+    cur_arena->stats.heap_bytes += asize;
+
+    // 初始化新的空闲块 header footer ，header 占用了原来结尾块的空间，保留其 PREV_ALLOC 位
+    PUT(HDRP(bp), PACK(asize, GET_PREV_ALLOC(HDRP(bp))));
+    PUT(FTRP(bp), PACK(asize, 0));
+    // 设置尾块
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
+
+    // 前面的块可能是 free block ，coalesce 会将新申请的 block 加入分离空闲链表
+    return coalesce(bp);
+}
+
+/*
+ * 如果空闲 block 地址紧邻的前后 block 是 free 的，需要合并块
+ * 不会出现前面或者后面连续的 block （否则之前的状态有问题），就是说合并操作不需要递归或者循环
+ *
+ * 作用：
+ * 1. 处理四种情况下的合并： 前 A 后 A 、前 A 后 F 、前 F 后 A 、前 F 后 F
+ * 1. 如果前后或后面的块有是 free 状态的，需要将其从分离空闲链表摘除
+ * 1. 合并 block ，先计算 size ，必须先设置合并后地址的 header ，然后设置 footer
+ * 1. 合并后的空闲链表，加入分离空闲链表中
+ * 1. 返回值是合并后的 free block 的地址，如果前面 block 是 free 的，那么返回值是前面 block 的地址
+ */
+
+static void *coalesce(void *bp)
+{
+    char   *next      = NEXT_BLKP(bp);
+    // 因为有序言块和结尾块，这里不需要额外的判断
+    // 前一个 block 已分配时没有 footer ，不能使用 PREV_BLKP ，通过 PREV_ALLOC 位判断
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+    size_t next_alloc = GET_ALLOC(HDRP(next));
+    size_t size       = GET_SIZE(HDRP(bp));
+
+    // 前 F ，将 prev free block 从空闲链表删除，合并后的 block 是前面 block 的地址
+    if (!prev_alloc)
+    {
+        char *prev = PREV_BLKP(bp);
+        delete_from_segregated_list(prev);
+        size += GET_SIZE(HDRP(prev));
+        bp = prev;
+        cur_arena->stats.coalesces++;
+    }
+
+    // 后 F ，将 next free block 从空闲链表删除
+    if (!next_alloc)
+    {
+        delete_from_segregated_list(next);
+        size += GET_SIZE(HDRP(next));
+        cur_arena->stats.coalesces++;
+    }
+
+    // 设置合并后 block 的 header ，footer 和后一个 block 的 PREV_ALLOC 位在插入空闲链表时设置
+    // 前面的 block 一定是已分配的（否则之前的状态有问题）
+    PUT(HDRP(bp), PACK(size, PREV_ALLOC));
+    insert_to_segregated_list(bp);
+
+#ifdef HEAP_CHECK
+    // 游标指向的 block 被合并了，移到合并后的 block
+    if (cur_arena->check_cursor > (char *)bp && cur_arena->check_cursor < (char *)bp + size)
+    {
+        cur_arena->check_cursor = bp;
+    }
+#endif
+#ifdef DEBUG
+    arena_checkheap(__LINE__);
+#endif
+    return bp;
+}
+
+/*
+ * 分离空闲链表的入口，如果只使用一个指针，开头都需要做特殊处理
+ * 因此使用空间换取时间的方法，每个入口（头节点）使用两个指针的空间，
+ * 分别保存 perd 和 succ 两个指针，和正常的空闲块一样（这样在链表头节点不再需要特殊处理）
+ * 但是头节点并没有 header 和 footer 空间，不可以在头节点获取块的大小，头节点默认块大小为 0
+ */
+
+/*
+ * 根据 size 计算所在的分离空闲链表的编号
+ *
+ * 1. size <= 32 的都在第 0 组
+ * 1. 其他的 size 向上取整到 2 的幂次 2^n ，所在的组为 n - 5 ，用 clz 计算，不需要逐个比较
+ * 1. 超过 4096 的都在最后一组
+ * 1. 定义 SIZE_CLASS_PROFILE 时，分组由 mm-classes.h 给出，直接查表
+ */
+static inline size_t size_to_class(size_t size)
+{
+#ifdef SIZE_CLASS_PROFILE
+    static const uint8_t class_table[] = SEGREGATED_CLASS_TABLE;
+
+    // block 的 size 都是 8 的倍数
+    return size <= SEGREGATED_CLASS_MAX ? class_table[size / ALIGNMENT] : SEGREGATED_FREE_LIST_NUM - 1;
+#else
+    if (size <= (1UL << SEGREGATED_FREE_LIST_MIN_SHIFT))
+    {
+        return 0;
     }
+
+    // ceil(log2(size)) = 64 - clz(size - 1)
+    size_t shift = sizeof(unsigned long) * 8 - __builtin_clzl(size - 1);
+    size_t index = shift - SEGREGATED_FREE_LIST_MIN_SHIFT;
+
+    return index < SEGREGATED_FREE_LIST_NUM ? index : SEGREGATED_FREE_LIST_NUM - 1;
+#endif
+}
+
+#ifdef SIZE_CLASS_PROFILE
+/*
+ * size 是否在 mm-classes.h 给出的第 index 组的边界之内
+ * 1. 只在检查时使用，和 size_to_class 查表的结果互相验证，生成的表有错时可以发现
+ * 1. 最后一组没有上界
+ */
+static int class_contains(size_t index, size_t size)
+{
+    static const uint32_t class_limits[] = SEGREGATED_CLASS_LIMITS;
+
+    return (index == 0 || size > class_limits[index - 1]) && (index == TREE_CLASS || size <= class_limits[index]);
+}
+#endif
+
+/*
+ * 查找对应的分离空闲链表入口
+ * 作用：
+ * 1. 根据 size 的大小，返回对应链表的起始地址
+ */
+static uint32_t *find_entry_in_segregated_list(size_t size)
+{
+    return SEGREGATED_ENTRY(size_to_class(size));
 }
 
 /*
  * 将新分配或者释放合并后的 block 加入到分离空闲链表
  *
- * 1. 插入前 block 的 pred 和 succ 指针是无效的；但 header 和 footer 中的 size 必然是有效的，否则不是一个正确的 block
- * 1. 清空 allocated bit -- TODO
+ * 1. 插入前 block 的 pred 和 succ 指针是无效的；但 header 中的 size 必然是有效的，否则不是一个正确的 block
+ * 1. 清空 allocated bit ，设置 footer ，清空后一个 block 的 PREV_ALLOC 位
  * 1. 获取 block 的 size ，得到分离空闲链表的头节点
  * 1. 插入的时候，头节点同样不需要特殊的处理
  * 1. 是否在尾节点插入需要特殊判断
@@ -506,31 +1263,46 @@ static int insert_to_segregated_list(void *bp)
     size_t size = GET_SIZE(HDRP(bp));
 #if 1
     // 清空 allocated bit
-    PUT(HDRP(bp), PACK(size, 0x0));
+    PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
     PUT(FTRP(bp), PACK(size, 0x0));
+    CLEAR_PREV_ALLOC(NEXT_BLKP(bp));
 #endif
 
     // pred 指向空闲链表中待插入节点的前一个节点
     // succ 指向空闲链表中待插入节点的后一个节点
     // bp 插入 prev 和 next 中间
-    char *pred = (char *)find_entry_in_segregated_list(size);
+    size_t index = size_to_class(size);
+    char *pred = (char *)SEGREGATED_ENTRY(index);
     char *succ = SUCC_BLKP(pred);
 
-    while (succ != NULL && size > GET_SIZE(succ))
+    // 链表非空，设置位图
+    BITMAP_SET(index);
+    cur_arena->stats.class_free_blocks[index]++;
+    cur_arena->stats.class_free_bytes[index] += size;
+
+    // 最后一组插入 AVL 树
+    if (index == TREE_CLASS)
+    {
+        char *root = tree_insert(TREE_ROOT, (char *)bp);
+        *TREE_ROOTP = PTR_TO_OFFSET(root);
+        return MEM_SUCCESS;
+    }
+
+    while (succ != NULL && size > GET_SIZE(HDRP(succ)))
     {
         pred = succ;
         succ = SUCC_BLKP(succ);
     }
 
     // 先设置待插入节点的前驱和后继
-    PRED_BLKP(bp) = pred;
-    SUCC_BLKP(bp) = SUCC_BLKP(pred);
+    SET_PRED(bp, pred);
+    SET_SUCC(bp, succ);
     // 设置前驱的后继
-    SUCC_BLKP(pred) = bp;
+    SET_SUCC(pred, bp);
     // 设置后继的前驱
     if (succ != NULL)
     {
-        PRED_BLKP(succ) = bp;
+        SET_PRED(succ, bp);
     }
 
     return MEM_SUCCESS;
@@ -539,7 +1311,7 @@ static int insert_to_segregated_list(void *bp)
 /*
  * 将指定的 block 从分离空闲链表中删除
  *
- * 1. 置位 allocated bit ；从分离空闲链表删除，表明其是分配 TODO 要不要在这里处理呢？
+ * 1. 置位 allocated bit ，置位后一个 block 的 PREV_ALLOC 位；从分离空闲链表删除，表明其是分配的
  * 1. 被删除的 block 的 pred 肯定存在，不需要额外的判断；而且也不需要关心空闲链表的入口位置
  * 1. 被删除的 block 的 succ 不一定存在，是否为空，需要特殊处理
 
@@ -557,144 +1329,1137 @@ static int delete_from_segregated_list(void *bp)
 #if 1
     // 置位 allocated bit
     size_t size = GET_SIZE(HDRP(bp));
-    PUT(HDRP(bp), PACK(size, 0x1));
-    PUT(FTRP(bp), PACK(size, 0x1));
+    PUT(HDRP(bp), GET(HDRP(bp)) | 0x1);
+    SET_PREV_ALLOC(NEXT_BLKP(bp));
 #endif
+    cur_arena->stats.class_free_blocks[size_to_class(size)]--;
+    cur_arena->stats.class_free_bytes[size_to_class(size)] -= size;
+
+    // 最后一组从 AVL 树删除
+    if (size_to_class(size) == TREE_CLASS)
+    {
+        char *root = tree_delete(TREE_ROOT, (char *)bp);
+        *TREE_ROOTP = PTR_TO_OFFSET(root);
+        if (root == NULL)
+        {
+            BITMAP_CLEAR(TREE_CLASS);
+        }
+        return MEM_SUCCESS;
+    }
 
     char *pred = PRED_BLKP(bp);
     char *succ = SUCC_BLKP(bp);
 
-    SUCC_BLKP(pred) = succ;
+    SET_SUCC(pred, succ);
 
     if (succ != NULL)
     {
-        PRED_BLKP(succ) = pred;
+        SET_PRED(succ, pred);
+    }
+    // 删除的是链表中唯一的 block ，清空位图
+    else if (SUCC_BLKP(find_entry_in_segregated_list(size)) == NULL)
+    {
+        BITMAP_CLEAR(size_to_class(size));
     }
 
     return MEM_SUCCESS;
 }
 
 /*
- * first fit 查找合适的 block ，未找到则扩张堆的大小
- * csapp 上面查找不到合适的 block 是在 malloc 函数中扩张堆的大小，
- * 但是我感觉在 find_fit 函数中实现更合理，因为这个函数就是为了找到合适的 block ，供其他函数调用
- *
- * 使用分离空闲链表，且按照 block 的大小排序，first fist 就是 best fit
- * 1. 先已经需要的 size 找到分离空闲链表的头节点
- * 1. 在该空闲链表上面无法找到满足需要 size 的 block ，则查找后一个空闲链表，知道最后一个空闲链表
- * 1. 如果仍然查找不到，则需要 extend_heap
+ * 将 bp 插入以 root 为根的 AVL 树，返回新的树根
+ * 1. 递归的深度是树的高度，不超过 1.44 * log2(n)
+ * 1. PTR_TO_OFFSET 会计算两次参数，递归调用的返回值要先保存到局部变量
  */
-static void *find_fit(size_t asize)
+static char *tree_insert(char *root, char *bp)
 {
-    void *bp = NULL;
+    if (root == NULL)
+    {
+        SET_LEFT(bp, NULL);
+        SET_RIGHT(bp, NULL);
+        SET_HEIGHT(bp, 1);
+        return bp;
+    }
+
+    char *child = NULL;
+    if (TREE_LESS(bp, root))
+    {
+        child = tree_insert(TREE_LEFT(root), bp);
+        SET_LEFT(root, child);
+    }
+    else
+    {
+        child = tree_insert(TREE_RIGHT(root), bp);
+        SET_RIGHT(root, child);
+    }
+
+    return tree_balance(root);
+}
+
+/*
+ * 从以 root 为根的 AVL 树中删除 bp ，返回新的树根
+ * 1. bp 一定在树中，按 (size, 地址) 查找，所以删除前 bp 的 size 不能修改
+ * 1. bp 有两个子树时，用右子树中最小的 block 代替 bp
+ */
+static char *tree_delete(char *root, char *bp)
+{
+    if (root == NULL)
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        return NULL;
+    }
+
+    if (root != bp)
+    {
+        char *child = NULL;
+        if (TREE_LESS(bp, root))
+        {
+            child = tree_delete(TREE_LEFT(root), bp);
+            SET_LEFT(root, child);
+        }
+        else
+        {
+            child = tree_delete(TREE_RIGHT(root), bp);
+            SET_RIGHT(root, child);
+        }
+        return tree_balance(root);
+    }
+
+    char *left  = TREE_LEFT(root);
+    char *right = TREE_RIGHT(root);
+    if (left == NULL)
+    {
+        return right;
+    }
+    if (right == NULL)
+    {
+        return left;
+    }
+
+    char *min = NULL;
+    right = tree_delete_min(right, &min);
+    SET_LEFT(min, left);
+    SET_RIGHT(min, right);
+
+    return tree_balance(min);
+}
+
+/*
+ * 删除以 root 为根的树中最小的 block ，通过 min 返回，函数返回新的树根
+ */
+static char *tree_delete_min(char *root, char **min)
+{
+    char *left = TREE_LEFT(root);
+    if (left == NULL)
+    {
+        *min = root;
+        return TREE_RIGHT(root);
+    }
+
+    left = tree_delete_min(left, min);
+    SET_LEFT(root, left);
+
+    return tree_balance(root);
+}
+
+/*
+ * 更新 bp 的高度，左右子树的高度差为 2 时旋转，返回旋转后的子树根
+ * 1. 左左、右右旋转一次，左右、右左先旋转子树再旋转 bp
+ */
+static char *tree_balance(char *bp)
+{
+    char   *left   = TREE_LEFT(bp);
+    char   *right  = TREE_RIGHT(bp);
+    size_t lheight = TREE_HEIGHT(left);
+    size_t rheight = TREE_HEIGHT(right);
+
+    if (lheight > rheight + 1)
+    {
+        // 左右的情况，左子树先左旋
+        if (TREE_HEIGHT(TREE_RIGHT(left)) > TREE_HEIGHT(TREE_LEFT(left)))
+        {
+            char *pivot = TREE_RIGHT(left);
+            SET_RIGHT(left, TREE_LEFT(pivot));
+            SET_LEFT(pivot, left);
+            SET_HEIGHT(left, MAX(TREE_HEIGHT(TREE_LEFT(left)), TREE_HEIGHT(TREE_RIGHT(left))) + 1);
+            left = pivot;
+        }
+        // 右旋
+        SET_LEFT(bp, TREE_RIGHT(left));
+        SET_RIGHT(left, bp);
+        SET_HEIGHT(bp, MAX(TREE_HEIGHT(TREE_LEFT(bp)), rheight) + 1);
+        SET_HEIGHT(left, MAX(TREE_HEIGHT(TREE_LEFT(left)), TREE_HEIGHT(bp)) + 1);
+        return left;
+    }
+
+    if (rheight > lheight + 1)
+    {
+        // 右左的情况，右子树先右旋
+        if (TREE_HEIGHT(TREE_LEFT(right)) > TREE_HEIGHT(TREE_RIGHT(right)))
+        {
+            char *pivot = TREE_LEFT(right);
+            SET_LEFT(right, TREE_RIGHT(pivot));
+            SET_RIGHT(pivot, right);
+            SET_HEIGHT(right, MAX(TREE_HEIGHT(TREE_LEFT(right)), TREE_HEIGHT(TREE_RIGHT(right))) + 1);
+            right = pivot;
+        }
+        // 左旋
+        SET_RIGHT(bp, TREE_LEFT(right));
+        SET_LEFT(right, bp);
+        SET_HEIGHT(bp, MAX(lheight, TREE_HEIGHT(TREE_RIGHT(bp))) + 1);
+        SET_HEIGHT(right, MAX(TREE_HEIGHT(bp), TREE_HEIGHT(TREE_RIGHT(right))) + 1);
+        return right;
+    }
+
+    SET_HEIGHT(bp, MAX(lheight, rheight) + 1);
+    return bp;
+}
+
+/*
+ * 在 AVL 树中查找 size 不小于 asize 的最小 block ，size 相同时取地址最小的，即 best fit
+ */
+static char *tree_find_fit(size_t asize)
+{
+    char *bp   = TREE_ROOT;
+    char *best = NULL;
+
+    while (bp != NULL)
+    {
+        if (GET_SIZE(HDRP(bp)) >= asize)
+        {
+            best = bp;
+            bp   = TREE_LEFT(bp);
+        }
+        else
+        {
+            bp = TREE_RIGHT(bp);
+        }
+        cur_arena->stats.fit_steps++;
+    }
+
+    return best;
+}
+
+/*
+ * first fit 查找合适的 block ，未找到则扩张堆的大小
+ * csapp 上面查找不到合适的 block 是在 malloc 函数中扩张堆的大小，
+ * 但是我感觉在 find_fit 函数中实现更合理，因为这个函数就是为了找到合适的 block ，供其他函数调用
+ *
+ * 使用分离空闲链表，且按照 block 的大小排序，first fist 就是 best fit
+ * 1. 先根据需要的 size 找到分离空闲链表的头节点，在该链表中查找（链表非空时）
+ * 1. 该链表中无法找到满足需要 size 的 block ，通过位图找到后面第一个非空的链表，
+ *    其中任意 block 都满足要求，链表有序，第一个就是最合适的，不需要遍历空的链表
+ * 1. 如果仍然查找不到，则需要 extend_heap
+ */
+static void *find_fit(size_t asize)
+{
+    void *bp = NULL;
+
+    if (asize == 0)
+    {
+        return NULL;
+    }
+
+    cur_arena->stats.fit_calls++;
+
+    size_t index = size_to_class(asize);
+    // 最后一组在 AVL 树中查找不小于 asize 的最小 block
+    if (index == TREE_CLASS)
+    {
+        bp = tree_find_fit(asize);
+    }
+    // 对应的链表非空，遍历该链表
+    else if (BITMAP_TEST(index))
+    {
+        char *succ = SUCC_BLKP(SEGREGATED_ENTRY(index));
+        while (succ != NULL && asize > GET_SIZE(HDRP(succ)))
+        {
+            succ = SUCC_BLKP(succ);
+            cur_arena->stats.fit_steps++;
+        }
+        bp = (void *)succ;
+    }
+
+    // 后面的链表中的 block 都大于 asize ，取第一个非空链表的第一个 block
+    if (bp == NULL)
+    {
+        size_t mask = cur_arena->free_bitmap & (~0UL << (index + 1));
+        if (mask != 0)
+        {
+            size_t next = __builtin_ctzl(mask);
+            // 后面的组是 AVL 树时取最小的 block
+            bp = next == TREE_CLASS ? tree_find_fit(asize) : (void *)SUCC_BLKP(SEGREGATED_ENTRY(next));
+        }
+    }
+
+#ifdef DEFERRED_COALESCE
+    // 合并快速 bin 中的 block 之后可能有满足要求的 block ，再查找一次
+    // 第二次查找时快速 bin 都是空的，不会再递归
+    if (bp == NULL && fastbin_consolidate() != 0)
+    {
+        return find_fit(asize);
+    }
+#endif
+
+    // 空闲链表中没有满足要求的 block
+    if (bp == NULL)
+    {
+        // 扩展堆的大小是 asize 和 CHUNKSIZE 中的较大者
+        // 扩张块，如果扩张失败 bp 仍然是 NULL
+        bp = extend_heap(MAX(asize, CHUNKSIZE));
+    }
+
+    return bp;
+}
+
+/*
+ * 入参：
+ * bp 是查找到的 free block
+ * asize 需要的 block size
+ *
+ * 1. 将 bp 从空闲链表删除（无论是否分割都需要处理）
+ * 1. 当 bp 的 size 减去 asize 剩余的部分大于最小块时，需要将 bp 分割成两部分
+ * 1. 将分割后剩余的 block 插入空闲链表
+ */
+static void place(void *bp, size_t asize)
+{
+    size_t split_size = GET_SIZE(HDRP(bp)) - asize;
+
+    // 从空闲链表删除会设置 allocated bit
+    if (delete_from_segregated_list(bp) != MEM_SUCCESS)
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        return;
+    }
+
+    if (split_size >= MIN_BLOCK_SIZE)
+    {
+        // 修改 header 的 size ，已分配的 block 没有 footer
+        PUT(HDRP(bp), PACK(asize, GET_PREV_ALLOC(HDRP(bp)) | 0x1));
+
+        // 分割后剩余的 block
+        char *split_bp = NEXT_BLKP(bp);
+        cur_arena->stats.splits++;
+
+        // 设置其 header ，footer 在插入空闲链表时设置
+        PUT(HDRP(split_bp), PACK(split_size, PREV_ALLOC));
+
+        // 插入空闲链表
+        if (insert_to_segregated_list(split_bp) != MEM_SUCCESS)
+        {
+            dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        }
+    }
+#ifdef DEBUG
+    arena_checkheap(__LINE__);
+#endif
+}
+
+#ifdef HEAP_TRIM
+/*
+ * 将很大的空闲 block 占用的内存还给系统，bp 已经在空闲链表中
+ *
+ * 1. 堆末尾的 block 超过 TRIM_THRESHOLD 时收缩 brk ，block 缩小到 TRIM_PAD ，避免下次分配马上又扩展堆
+ * 1. 堆中间的 block 超过 RELEASE_THRESHOLD 时，释放 AVL 树节点之后到 footer 之前完整的页
+ */
+static void release_free_block(void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+
+    // 不是最后一个 block
+    if (GET_SIZE(HDRP(NEXT_BLKP(bp))) != 0)
+    {
+        if (size >= RELEASE_THRESHOLD)
+        {
+            mem_release((char *)bp + 3 * WSIZE, size - 5 * WSIZE);
+        }
+        return;
+    }
+
+    if (size < TRIM_THRESHOLD)
+    {
+        return;
+    }
+
+    // 从空闲链表中删除，收缩 brk 之后，重新设置 header 和结尾块，再插入空闲链表
+    // 前面的 block 一定是已分配的，插入时会设置 footer 和结尾块的 PREV_ALLOC 位
+    delete_from_segregated_list(bp);
+    mem_arena_sbrk(cur_arena->index, -(int)(size - TRIM_PAD));
+    cur_arena->stats.heap_bytes -= size - TRIM_PAD;
+    PUT(HDRP(bp), PACK(TRIM_PAD, PREV_ALLOC));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
+    insert_to_segregated_list(bp);
+}
+#endif /* HEAP_TRIM */
+
+/*
+ * 已分配的 block 原地缩小到 asize
+ *
+ * 1. 剩余部分不小于最小块时才分割，否则保持原来的大小
+ * 1. 分割出来的 block 后面可能是 free block ，需要调用 coalesce 合并后再加入空闲链表
+ */
+static void shrink_block(void *bp, size_t asize)
+{
+    size_t split_size = GET_SIZE(HDRP(bp)) - asize;
+
+    if (split_size < MIN_BLOCK_SIZE)
+    {
+        return;
+    }
+
+    PUT(HDRP(bp), PACK(asize, GET_PREV_ALLOC(HDRP(bp)) | 0x1));
+
+    char *split_bp = NEXT_BLKP(bp);
+    PUT(HDRP(split_bp), PACK(split_size, PREV_ALLOC));
+    cur_arena->stats.splits++;
+    coalesce(split_bp);
+}
+
+/*
+ * 已分配的 block 原地扩大到 asize ，成功返回 MEM_SUCCESS
+ *
+ * 1. 后面的 block 是 free 的，且合并后足够大，从空闲链表删除后直接合并
+ * 1. 后面是结尾块，或者后面的 free block 是堆中最后一个 block ，只扩展不足的部分，
+ *    扩展后的 block 和后面的 free block 合并，再按照第一种情况处理
+ * 1. 合并后多余的部分交给 shrink_block 分割
+ */
+static int grow_block(void *bp, size_t asize)
+{
+    size_t size      = GET_SIZE(HDRP(bp));
+    char   *next     = NEXT_BLKP(bp);
+    size_t next_size = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
+
+    if (size + next_size < asize)
+    {
+        // 当前 block 后面（可能隔着一个 free block）是结尾块，扩展堆
+        char *last = next_size ? NEXT_BLKP(next) : next;
+        if (GET_SIZE(HDRP(last)) != 0)
+        {
+            return MEM_ERROR;
+        }
+
+        // extend_heap 会和后面的 free block 合并并加入空闲链表，合并后的 block 就是 next
+        if (extend_heap(asize - size - next_size) == NULL)
+        {
+            return MEM_ERROR;
+        }
+        next_size = GET_SIZE(HDRP(next));
+    }
+
+    // 从空闲链表删除，合并到当前 block
+    delete_from_segregated_list(next);
+    size += next_size;
+    PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp)) | 0x1));
+#ifdef HEAP_CHECK
+    if (cur_arena->check_cursor == next)
+    {
+        cur_arena->check_cursor = bp;
+    }
+#endif
+
+    shrink_block(bp, asize);
+
+    return MEM_SUCCESS;
+}
+
+#ifdef PRELOAD
+/*
+ * 分配一个 payload 按 align 对齐、大小为 asize 的 block ，align 是 2 的幂次
+ *
+ * 1. 先分配一个足够大的 block ，保证其中有对齐的位置，且对齐位置前面的部分足够一个最小块
+ * 1. 这个 block 超过 INT_MAX 时直接失败，否则 mem_arena_sbrk 的 int 参数变成负数，会收缩堆
+ * 1. 对齐位置前面的部分释放，会和前面的 free block 合并
+ * 1. 后面多余的部分交给 shrink_block 分割
+ */
+static void *alloc_aligned_block(size_t align, size_t asize)
+{
+    size_t total = asize + align + MIN_BLOCK_SIZE;
+    char   *bp   = NULL;
+
+    if (total > INT_MAX)
+    {
+        return NULL;
+    }
+
+    bp = find_fit(total);
+    if (bp == NULL)
+    {
+        return NULL;
+    }
+    place(bp, total);
+
+    char *abp = (char *)(((size_t)bp + align - 1) & ~(align - 1));
+    if (abp != bp && (size_t)(abp - bp) < MIN_BLOCK_SIZE)
+    {
+        abp += align;
+    }
+
+    return split_aligned_block(bp, abp, asize);
+}
+#endif
+
+#if defined(SLAB_FRONTEND) || defined(PRELOAD)
+/*
+ * 已分配的 block bp 中从 abp 开始取出大小为 asize 的 block
+ * 1. abp 前面的部分至少是一个最小块，释放，会和前面的 free block 合并
+ * 1. 后面多余的部分交给 shrink_block 分割
+ */
+static void *split_aligned_block(char *bp, char *abp, size_t asize)
+{
+    if (abp != bp)
+    {
+        size_t size  = GET_SIZE(HDRP(bp));
+        size_t front = abp - bp;
+
+        // 先设置对齐后 block 的 header ，前面的 block 马上就会释放
+        PUT(HDRP(abp), PACK(size - front, 0x1));
+        PUT(HDRP(bp), PACK(front, GET_PREV_ALLOC(HDRP(bp)) | 0x1));
+        coalesce(bp);
+    }
+
+    shrink_block(abp, asize);
+
+    return abp;
+}
+#endif
+
+#ifdef SLAB_FRONTEND
+/*
+ * 地址 ptr 是否是 slab 分配的 slot ，通过所在页的页位图判断
+ */
+static inline int is_slab_ptr(void *ptr)
+{
+    if ((char *)ptr < (char *)mem_heap_lo())
+    {
+        return 0;
+    }
+
+    size_t page = SLAB_PAGE(ptr);
+    return page < SLAB_PAGE_NUM && ((slab_page_map[page / 64] >> (page % 64)) & 0x1);
+}
+
+/*
+ * 在第 index 组的 slab 链表头部插入 run
+ */
+static void slab_list_insert(slab_run_t *run)
+{
+    uint32_t *entry = cur_arena->slab_listp + run->class_index;
+    char     *succ  = OFFSET_TO_PTR(*entry);
+
+    run->pred = 0;
+    run->succ = *entry;
+    if (succ != NULL)
+    {
+        ((slab_run_t *)succ)->pred = PTR_TO_OFFSET(run);
+    }
+    *entry = PTR_TO_OFFSET(run);
+}
+
+/*
+ * 将 run 从所在组的 slab 链表删除
+ */
+static void slab_list_delete(slab_run_t *run)
+{
+    slab_run_t *pred = (slab_run_t *)OFFSET_TO_PTR(run->pred);
+    slab_run_t *succ = (slab_run_t *)OFFSET_TO_PTR(run->succ);
+
+    if (pred != NULL)
+    {
+        pred->succ = run->succ;
+    }
+    else
+    {
+        cur_arena->slab_listp[run->class_index] = run->succ;
+    }
+
+    if (succ != NULL)
+    {
+        succ->pred = run->pred;
+    }
+}
+
+/*
+ * 从堆顶切出一个新的 run ，不经过 find_fit
+ *
+ * 1. 堆的最后一个 block 是 free 的时候从这个 block 开始，否则从结尾块开始
+ * 1. run 的 payload 在之后第一个页边界，前面的部分不够一个最小块时再往后一页，前面的部分释放给后端
+ * 1. 堆顶不够一页时只扩展不足的部分，第一次把 brk 补齐到页边界，之后每个 run 正好扩展一页
+ */
+static slab_run_t *slab_new_run(void)
+{
+    char *end = (char *)mem_arena_hi(cur_arena->index) + 1; /* 结尾块 */
+    char *bp  = GET_PREV_ALLOC(HDRP(end)) ? end : PREV_BLKP(end);
+
+    char *abp = (char *)(((size_t)bp + SLAB_RUN_SIZE - 1) & ~(size_t)(SLAB_RUN_SIZE - 1));
+    if (abp != bp && (size_t)(abp - bp) < MIN_BLOCK_SIZE)
+    {
+        abp += SLAB_RUN_SIZE;
+    }
+
+    // run 的最后 4 字节是下一个 block 的 header ，extend_heap 和最后的 free block 合并后的 block 就是 bp
+    if (abp + SLAB_RUN_SIZE > end && extend_heap(abp + SLAB_RUN_SIZE - end) == NULL)
+    {
+        return NULL;
+    }
+    place(bp, GET_SIZE(HDRP(bp)));
+
+    return (slab_run_t *)split_aligned_block(bp, abp, SLAB_RUN_SIZE);
+}
+
+/*
+ * slab 分配
+ *
+ * 1. 取对应组链表的第一个 run ，没有 run 时请求还不够多则返回 NULL 交给后端
+ * 1. 否则从堆顶切出一页作为新的 run ，初始化 slot 链表并设置页位图
+ * 1. 取 run 的第一个空闲 slot
+ * 1. run 没有空闲 slot 后从链表删除
+ */
+static void *slab_malloc(size_t size)
+{
+    size_t     index = (size - 1) / SLAB_GRANULE;
+    slab_run_t *run  = (slab_run_t *)OFFSET_TO_PTR(cur_arena->slab_listp[index]);
+
+    if (run == NULL)
+    {
+        // 请求少的组由后端分配，避免每组都占一页
+        if (++cur_arena->slab_demand[index] < SLAB_SLOT_NUM(index) * SLAB_RUN_DEMAND)
+        {
+            return NULL;
+        }
+
+        run = slab_new_run();
+        if (run == NULL)
+        {
+            return NULL;
+        }
+        cur_arena->slab_demand[index] = 0;
+
+        size_t slot_size = SLAB_SLOT_SIZE(index);
+        size_t slot_num  = SLAB_SLOT_NUM(index);
+        run->class_index = index;
+        run->free_num    = slot_num;
+        run->free_head   = SLAB_HDR_SIZE;
+        for (size_t i = 0; i < slot_num; i++)
+        {
+            size_t offset = SLAB_HDR_SIZE + i * slot_size;
+            PUT((char *)run + offset, i + 1 < slot_num ? offset + slot_size : 0);
+        }
+        slab_list_insert(run);
+
+        size_t page = SLAB_PAGE(run);
+        __atomic_fetch_or(&slab_page_map[page / 64], 1UL << (page % 64), __ATOMIC_RELAXED);
+    }
+
+    char *slot = (char *)run + run->free_head;
+    run->free_head = GET(slot);
+    if (--run->free_num == 0)
+    {
+        slab_list_delete(run);
+    }
+
+    dbg_printf("slab malloc size %lu => %p\n", size, slot);
+    return slot;
+}
+
+/*
+ * slab 释放
+ *
+ * 1. slot 插入 run 的空闲链表头部
+ * 1. run 原来没有空闲 slot ，重新加入链表
+ * 1. run 全部空闲，清空页位图后归还给后端，该组重新由后端分配，直到请求又足够多
+ */
+static void slab_free(void *ptr)
+{
+    slab_run_t *run = SLAB_RUNP(ptr);
+
+    PUT(ptr, run->free_head);
+    run->free_head = (char *)ptr - (char *)run;
+    if (run->free_num++ == 0)
+    {
+        slab_list_insert(run);
+    }
+
+    if (run->free_num == SLAB_SLOT_NUM(run->class_index))
+    {
+        slab_list_delete(run);
+
+        size_t page = SLAB_PAGE(run);
+        __atomic_fetch_and(&slab_page_map[page / 64], ~(1UL << (page % 64)), __ATOMIC_RELAXED);
+        coalesce(run);
+    }
+
+    dbg_printf("slab free => %p\n", ptr);
+}
+
+/*
+ * 检查 slab 链表
+ * 1. 链表中的 run 都在页位图中，所在的组正确，pred/succ 连续
+ * 1. run 至少有一个空闲 slot ，空闲 slot 链表的长度等于 free_num ，slot 的偏移都在 run 之内
+ */
+static void slab_checkheap(void)
+{
+    for (size_t index = 0; index < SLAB_CLASS_NUM; index++)
+    {
+        slab_run_t *pred = NULL;
+        slab_run_t *run  = (slab_run_t *)OFFSET_TO_PTR(cur_arena->slab_listp[index]);
+        while (run != NULL)
+        {
+            if (!is_slab_ptr(run) || run->class_index != index ||
+                (slab_run_t *)OFFSET_TO_PTR(run->pred) != pred ||
+                run->free_num == 0 || run->free_num > SLAB_SLOT_NUM(index))
+            {
+                dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+                exit(127);
+            }
+
+            size_t   free_num = 0;
+            uint32_t offset   = run->free_head;
+            while (offset != 0)
+            {
+                if (offset < SLAB_HDR_SIZE || offset + SLAB_SLOT_SIZE(index) > SLAB_PAYLOAD_END ||
+                    (offset - SLAB_HDR_SIZE) % SLAB_SLOT_SIZE(index) != 0 || ++free_num > run->free_num)
+                {
+                    dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+                    exit(127);
+                }
+                offset = GET((char *)run + offset);
+            }
+
+            if (free_num != run->free_num)
+            {
+                dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+                exit(127);
+            }
+
+            pred = run;
+            run  = (slab_run_t *)OFFSET_TO_PTR(run->succ);
+        }
+    }
+}
+#endif /* SLAB_FRONTEND */
+
+#ifdef DEFERRED_COALESCE
+/* 快速 bin 的 block 通过 payload 的前 4 字节连接 */
+#define FASTBIN_NEXT(bp)  OFFSET_TO_PTR(GET(bp))
+
+/*
+ * 从快速 bin 中取一个大小正好是 asize 的 block
+ * 1. 快速 bin 中的 block 一直是已分配的，header 和下一个 block 的 PREV_ALLOC 位都不需要修改
+ */
+static void *fastbin_get(size_t asize)
+{
+    if (asize > FASTBIN_MAX_SIZE)
+    {
+        return NULL;
+    }
+
+    size_t index = FASTBIN_INDEX(asize);
+    char   *bp   = OFFSET_TO_PTR(cur_arena->fastbins[index]);
+    if (bp != NULL)
+    {
+        cur_arena->fastbins[index] = GET(bp);
+        cur_arena->fastbin_counts[index]--;
+    }
+
+    return bp;
+}
+
+/*
+ * 将 block 放入快速 bin ，成功返回 MEM_SUCCESS
+ * 1. 超过 FASTBIN_MAX_SIZE 的 block 返回 MEM_ERROR ，由调用者马上合并
+ * 1. 这一组已经有 FASTBIN_COUNT 个 block 时，先把这一组全部合并，避免碎片一直得不到合并
+ */
+static int fastbin_put(void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+    if (size > FASTBIN_MAX_SIZE)
+    {
+        return MEM_ERROR;
+    }
+
+    size_t index = FASTBIN_INDEX(size);
+    if (cur_arena->fastbin_counts[index] >= FASTBIN_COUNT)
+    {
+        fastbin_flush(index);
+    }
+
+    PUT(bp, cur_arena->fastbins[index]);
+    cur_arena->fastbins[index] = PTR_TO_OFFSET(bp);
+    cur_arena->fastbin_counts[index]++;
+
+    return MEM_SUCCESS;
+}
+
+/*
+ * 把第 index 组快速 bin 中的 block 依次合并，加入空闲链表，返回合并的 block 个数
+ * 1. 相邻的 block 如果还在快速 bin 中，仍然是已分配的，轮到它时再合并
+ */
+static size_t fastbin_flush(size_t index)
+{
+    size_t num = cur_arena->fastbin_counts[index];
+    char   *bp = OFFSET_TO_PTR(cur_arena->fastbins[index]);
+
+    // 先清空这一组，coalesce 不会访问快速 bin
+    cur_arena->fastbins[index]       = 0;
+    cur_arena->fastbin_counts[index] = 0;
+    while (bp != NULL)
+    {
+        char *next = FASTBIN_NEXT(bp);
+        coalesce(bp);
+        bp = next;
+    }
+
+    return num;
+}
+
+/*
+ * 合并所有的快速 bin ，返回合并的 block 个数，find_fit 找不到合适的 block 时调用
+ */
+static size_t fastbin_consolidate(void)
+{
+    size_t num = 0;
+
+    for (size_t index = 0; index < FASTBIN_NUM; index++)
+    {
+        if (cur_arena->fastbin_counts[index] != 0)
+        {
+            num += fastbin_flush(index);
+        }
+    }
+
+    return num;
+}
+
+/*
+ * 检查快速 bin
+ * 1. block 在 arena 之内，是已分配的，大小和所在的组一致
+ * 1. 链表的长度和计数一致，不超过 FASTBIN_COUNT
+ */
+static void fastbin_checkheap(void)
+{
+    for (size_t index = 0; index < FASTBIN_NUM; index++)
+    {
+        size_t num = 0;
+        char   *bp = OFFSET_TO_PTR(cur_arena->fastbins[index]);
+        while (bp != NULL)
+        {
+            if (bp < cur_arena->heap_listp || bp > (char *)mem_arena_hi(cur_arena->index))
+            {
+                dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+                exit(127);
+            }
+
+            if (!GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) != MIN_BLOCK_SIZE + index * ALIGNMENT)
+            {
+                dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+                exit(127);
+            }
+
+            num++;
+            bp = FASTBIN_NEXT(bp);
+        }
+
+        if (num != cur_arena->fastbin_counts[index] || num > FASTBIN_COUNT)
+        {
+            dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+            exit(127);
+        }
+    }
+}
+#endif /* DEFERRED_COALESCE */
+
+#ifdef THREAD_SAFE
+/*
+ * 从线程缓存中取一个 block ，不需要加锁
+ * 1. slab 负责的请求和超过 TCACHE_MAX_SIZE 的请求不使用缓存
+ * 1. 同一组的 block 大小完全相同，都满足请求
+ */
+static void *tcache_get(size_t size)
+{
+    if (size == 0 || size >= MAX_REQUEST_SIZE)
+    {
+        return NULL;
+    }
+#ifdef SLAB_FRONTEND
+    if (size <= SLAB_MAX_SIZE)
+    {
+        return NULL;
+    }
+#endif
+
+    size_t asize = adjust_size(size);
+    if (asize > TCACHE_MAX_SIZE)
+    {
+        return NULL;
+    }
+
+    size_t index = TCACHE_INDEX(asize);
+    char   *bp   = tcache.bins[index];
+    if (bp != NULL)
+    {
+        tcache.bins[index] = TCACHE_NEXT(bp);
+        tcache.counts[index]--;
+    }
+
+    return bp;
+}
+
+/*
+ * 将 block 放入线程缓存，成功返回 MEM_SUCCESS ，不需要加锁
+ * 1. free(NULL) 什么都不做，也算成功
+ * 1. 只读取 block 的 size ，其他线程只会修改 header 的 PREV_ALLOC 位，不影响 size
+ * 1. 第一次缓存 block 时注册 pthread_key ，线程退出时清空缓存
+ */
+static int tcache_put(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return MEM_SUCCESS;
+    }
+#ifdef SLAB_FRONTEND
+    if (is_slab_ptr(ptr))
+    {
+        return MEM_ERROR;
+    }
+#endif
+
+    size_t size = GET_SIZE(HDRP(ptr));
+    if (size > TCACHE_MAX_SIZE)
+    {
+        return MEM_ERROR;
+    }
+
+    size_t index = TCACHE_INDEX(size);
+    if (tcache.counts[index] >= TCACHE_COUNT)
+    {
+        return MEM_ERROR;
+    }
+
+    pthread_once(&tcache_key_once, tcache_key_create);
+    pthread_setspecific(tcache_key, &tcache);
+
+    TCACHE_NEXT(ptr) = tcache.bins[index];
+    tcache.bins[index] = ptr;
+    tcache.counts[index]++;
+
+    return MEM_SUCCESS;
+}
+
+/*
+ * 线程退出时调用，将当前线程缓存的所有 block 还给各自的 arena
+ */
+static void tcache_flush(void *arg)
+{
+    (void)arg;
+
+    for (size_t index = 0; index < TCACHE_BIN_NUM; index++)
+    {
+        while (tcache.bins[index] != NULL)
+        {
+            char *bp = tcache.bins[index];
+            tcache.bins[index] = TCACHE_NEXT(bp);
+            arena_free(bp);
+        }
+        tcache.counts[index] = 0;
+    }
+}
+
+static void tcache_key_create(void)
+{
+    pthread_key_create(&tcache_key, tcache_flush);
+}
+#endif /* THREAD_SAFE */
+
+#ifdef PRELOAD
+/*
+ * 第一次调用 malloc 等函数时由 pthread_once 调用，初始化 memlib 和堆
+ * 1. 每个 CPU 一个 arena ，最多 MEM_ARENA_MAX 个
+ * 1. 这里不能调用会 malloc 的函数，pthread_atfork 在 preload_constructor 中注册
+ */
+static void preload_init(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    mem_init();
+    mem_arena_setup(cpus < 1 ? 1 : (cpus > MEM_ARENA_MAX ? MEM_ARENA_MAX : (int)cpus));
+    if (mm_init() == MEM_ERROR)
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        exit(127);
+    }
+
+    __atomic_store_n(&preload_ready, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * 动态库加载时调用，注册 fork 的处理函数
+ */
+__attribute__((constructor)) static void preload_constructor(void)
+{
+    PRELOAD_INIT();
+    pthread_atfork(preload_fork_prepare, preload_fork_parent, preload_fork_child);
+}
+
+/*
+ * fork 之前按顺序锁住所有 arena ，保证子进程中的堆是一致的
+ * 1. 大的 block 由 mem_map 分配，不经过 arena 的锁，memlib 的 mapping 链表的锁最后拿
+ */
+static void preload_fork_prepare(void)
+{
+    for (int index = 0; index < ARENA_NUM(); index++)
+    {
+        pthread_mutex_lock(&arenas[index].lock);
+    }
+    mem_fork_prepare();
+}
+
+static void preload_fork_parent(void)
+{
+    mem_fork_parent();
+    for (int index = 0; index < ARENA_NUM(); index++)
+    {
+        pthread_mutex_unlock(&arenas[index].lock);
+    }
+}
+
+/*
+ * 子进程只有调用 fork 的线程，锁重新初始化即可
+ */
+static void preload_fork_child(void)
+{
+    mem_fork_child();
+    for (int index = 0; index < ARENA_NUM(); index++)
+    {
+        pthread_mutex_init(&arenas[index].lock, NULL);
+    }
+}
+
+/*
+ * memalign - payload 按 alignment 对齐
+ * 1. alignment 不超过 ALIGNMENT 时和 malloc 相同
+ * 1. 否则从当前线程绑定的 arena 开始，依次在每个 arena 中调用 alloc_aligned_block
+ * 1. 对齐的 block 是普通的 block ，free/realloc 不需要特殊处理
+ */
+void *memalign(size_t alignment, size_t size)
+{
+    PRELOAD_INIT();
+
+    if (alignment & (alignment - 1))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (alignment <= ALIGNMENT)
+    {
+        return malloc(size);
+    }
 
-    if (asize == 0)
+    if (size >= MAX_REQUEST_SIZE || alignment >= MAX_REQUEST_SIZE)
     {
+        errno = ENOMEM;
         return NULL;
     }
 
-    size_t *entry_listp = find_entry_in_segregated_list(asize);
-    // 外循环遍历分离空闲链表的所有入口
-    while (entry_listp < segregated_free_listp + SEGREGATED_FREE_LIST_ENTRY_SIZE)
+    arena_t *arena = thread_arena();
+    size_t  asize  = adjust_size(MAX(size, 1));
+    void    *bp    = NULL;
+
+    STATS_ADD(arena->stats.malloc_calls, 1);
+    for (int i = 0; bp == NULL && i < ARENA_NUM(); i++)
     {
-        // 内循环遍历单个空闲链表
-        char *pred = (char *)entry_listp;
-        char *succ = SUCC_BLKP(pred);
-        while (succ != NULL && asize > GET_SIZE(HDRP(succ)))
-        {
-            pred = succ;
-            succ = SUCC_BLKP(succ);
-        }
+        arena_t *cur = &arenas[(arena->index + i) % ARENA_NUM()];
+        ARENA_ENTER(cur);
+        bp = alloc_aligned_block(alignment, asize);
+        ARENA_LEAVE(cur);
+    }
 
-        // 如果 succ 不为空，说明找到了合适的 block
-        if (succ != NULL)
-        {
-            bp = (void *)succ;
-            break;
-        }
+    if (bp == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return bp;
+}
 
-        entry_listp += SEGREGATED_FREE_LIST_ENTRY_STEP;
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+    {
+        return EINVAL;
     }
 
-    // 空闲链表中没有满足要求的 block
-    if (bp == NULL)
+    void *ptr = memalign(alignment, size);
+    if (ptr == NULL)
     {
-        // 扩展堆的大小是 asize 和 CHUNKSIZE 中的较大者
-        // 扩张块，如果扩张失败 bp 仍然是 NULL
-        bp = extend_heap(MAX(asize, CHUNKSIZE));
+        return ENOMEM;
     }
 
-    return bp;
+    *memptr = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+    return memalign(mem_pagesize(), size);
 }
 
 /*
- * 入参：
- * bp 是查找到的 free block
- * asize 需要的 block size
- *
- * 1. 将 bp 从空闲链表删除（无论是否分割都需要处理）
- * 1. 当 bp 的 size 减去 asize 剩余的部分大于最小块时，需要将 bp 分割成两部分
- * 1. 将分割后剩余的 block 插入空闲链表
+ * pvalloc - size 向上取整到页的大小
  */
-static void place(void *bp, size_t asize)
+void *pvalloc(size_t size)
 {
-    size_t split_size = GET_SIZE(HDRP(bp)) - asize;
+    size_t page = mem_pagesize();
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
 
-    // 从空闲链表删除会设置 allocated bit
-    if (delete_from_segregated_list(bp) != MEM_SUCCESS)
+/*
+ * malloc_usable_size - payload 实际可用的字节数
+ * 1. 单独映射的 block ，header 中的 size 包括 payload 前面的 MMAP_OFFSET 字节
+ * 1. 堆中已分配的 block 没有 footer ，payload 到下一个 block 的 header 为止
+ */
+size_t malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL)
     {
-        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
-        return;
+        return 0;
     }
 
-    if (split_size >= MIN_BLOCK_SIZE)
+    if (is_mmapped_ptr(ptr))
     {
-        // 修改 header 和 footer 的 size 和 allocated bit
-        PUT(HDRP(bp), PACK(asize, 0x1));
-        PUT(FTRP(bp), PACK(asize, 0x1));
-
-        // 分割后剩余的 block
-        char *split_bp = NEXT_BLKP(bp);
-
-        // 设置其 header 和 footer
-        PUT(HDRP(split_bp), PACK(split_size, 0x0));
-        PUT(FTRP(split_bp), PACK(split_size, 0x0));
-
-        // 插入空闲链表
-        if (insert_to_segregated_list(split_bp) != MEM_SUCCESS)
-        {
-            dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
-        }
+        return GET_SIZE(HDRP(ptr)) - MMAP_OFFSET;
     }
-#ifdef DEBUG
-    mm_checkheap(__LINE__);
-#endif
-}
 
+    return GET_SIZE(HDRP(ptr)) - WSIZE;
+}
+#endif /* PRELOAD */
 
 static void mm_print_heap()
 {
     // 从序言块后一个节点开始往后遍历
-    char *bp = heap_listp;
+    char *bp = cur_arena->heap_listp;
     size_t block_num = 0;
     // 只有结尾块的 size 是 0
     dbg_printf("ALL BLOCKS--------\n");
     while (GET_SIZE(HDRP(bp)))
     {
         block_num++;
-        dbg_printf("block: %4lu - addr: %p - Halloc: %lu - Falloc: %lu - Hsize: %4lu - Fsize: %4lu\n",
+        dbg_printf("block: %4lu - addr: %p - alloc: %lu - prev_alloc: %lu - size: %4lu\n",
                    block_num, bp,
-                   GET_ALLOC(HDRP(bp)), GET_ALLOC(FTRP(bp)),
-                   GET_SIZE(HDRP(bp)),  GET_SIZE(FTRP(bp)));
+                   GET_ALLOC(HDRP(bp)), GET_PREV_ALLOC(HDRP(bp)) >> 1,
+                   GET_SIZE(HDRP(bp)));
 
         bp = NEXT_BLKP(bp);
     }
 
 
     dbg_printf("\nFREE LISTS--------\n");
-    size_t *entry_listp = segregated_free_listp;
+    uint32_t *entry_listp = SEGREGATED_ENTRY(0);
     // 外循环遍历分离空闲链表的所有入口
-    while (entry_listp < segregated_free_listp + SEGREGATED_FREE_LIST_ENTRY_SIZE)
+    while (entry_listp < SEGREGATED_ENTRY(TREE_CLASS))
     {
         // 内循环遍历单个空闲链表
         char *pred = (char *)entry_listp;
@@ -712,35 +2477,130 @@ static void mm_print_heap()
     }
 }
 
+/*
+ * mm_stats - 把所有 arena 的统计加起来
+ *
+ * 1. 计数都在 arena_t 中，加起来只需要 O(arena 个数) 的时间
+ * 1. 线程缓存和快速 bin 中的 block 对堆来说是已分配的，算在 in_use_bytes 中
+ * 1. largest_free 要在每个 arena 中找最后一个非空的组，见 arena_largest_free ，
+ *    树中是 O(log n) ，树为空时要遍历整个链表，mdriver -F 每次采样都会调用
+ */
+void mm_stats(mm_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->class_num = SEGREGATED_FREE_LIST_NUM;
+
+    for (int index = 0; index < ARENA_NUM(); index++)
+    {
+        arena_t    *arena = &arenas[index];
+        mm_stats_t *s     = &arena->stats;
+
+        ARENA_ENTER(arena);
+        stats->malloc_calls  += s->malloc_calls;
+        stats->free_calls    += s->free_calls;
+        stats->realloc_calls += s->realloc_calls;
+        stats->extend_calls  += s->extend_calls;
+        stats->splits        += s->splits;
+        stats->coalesces     += s->coalesces;
+        stats->fit_calls     += s->fit_calls;
+        stats->fit_steps     += s->fit_steps;
+        stats->heap_bytes    += s->heap_bytes;
+        for (int i = 0; i < SEGREGATED_FREE_LIST_NUM; i++)
+        {
+            stats->class_free_blocks[i] += s->class_free_blocks[i];
+            stats->class_free_bytes[i]  += s->class_free_bytes[i];
+            stats->in_use_bytes         -= s->class_free_bytes[i];
+        }
+        stats->largest_free = MAX(stats->largest_free, arena_largest_free());
+        ARENA_LEAVE(arena);
+    }
+
+    stats->heap_bytes   += mmap_bytes;
+    stats->in_use_bytes += stats->heap_bytes;
+}
+
+/*
+ * 当前 arena 空闲链表中最大的 free block 的 size ，没有 free block 时返回 0
+ *
+ * 1. 最大的 block 一定在最后一个非空的组中，由 free_bitmap 的最高位找到
+ * 1. 最后一组是 AVL 树时取最右边的节点
+ * 1. 其他组的链表按 size 升序排列，取链表的最后一个 block ，要遍历整个链表，
+ *    只在树为空时才会发生
+ */
+static size_t arena_largest_free(void)
+{
+    if (cur_arena->free_bitmap == 0)
+    {
+        return 0;
+    }
+
+    size_t index = 63 - __builtin_clzl(cur_arena->free_bitmap);
+    char  *bp;
+
+    if (index == TREE_CLASS)
+    {
+        bp = TREE_ROOT;
+        while (TREE_RIGHT(bp) != NULL)
+        {
+            bp = TREE_RIGHT(bp);
+        }
+    }
+    else
+    {
+        bp = SUCC_BLKP(SEGREGATED_ENTRY(index));
+        while (SUCC_BLKP(bp) != NULL)
+        {
+            bp = SUCC_BLKP(bp);
+        }
+    }
+
+    return GET_SIZE(HDRP(bp));
+}
+
 /*
  * mm_checkheap - 检查 heap 和 free list
  *
  * checking the heap -- 通过 header footer 检查
  * 1. 检查 epilogue 和 prologue
  * 1. 检查 block's address alignment
- * 1. 检查堆的边界
- * 1. 检查 header 和 footer 是否匹配，是否存在连续的 free block
+ * 1. 检查 arena 的边界
+ * 1. 检查 free block 的 header 和 footer 是否匹配，是否存在连续的 free block
+ * 1. 检查 PREV_ALLOC 位和前一个 block 的 allocated bit 是否一致
  *
  * checking the free list -- 通过 pred 和 succ
  * 1. pred/succ 是连续的， A's next is B, then B's pred must be A
- * 1. 所有的空闲链表都在 mem_heap_lo() 和 mem_heap_hight() 之间
+ * 1. 所有的空闲链表都在 mem_arena_lo() 和 mem_arena_hi() 之间
  * 1. 通过 header footer 计算 free block 的个数，等于通过 pred succ 得到的个数
- * 1. 分离空闲链表中，各个 free block size 在该链表的范围之内
+ * 1. 分离空闲链表中，各个 free block size 在该链表的范围之内，定义 SIZE_CLASS_PROFILE 时再和 mm-classes.h 的边界比较
  */
 void mm_checkheap(int verbose)
 {
-    verbose = verbose;
-    dbg_printf("call by line-%d\n", verbose);
+    for (int index = 0; index < ARENA_NUM(); index++)
+    {
+        ARENA_SWITCH(&arenas[index]);
+        arena_checkheap(verbose);
+    }
+}
+
+/*
+ * 检查当前的 arena ，mm_checkheap 的说明中的每一项都只针对这个 arena
+ * heap_malloc 等函数在 DEBUG 时调用，只检查自己持有锁的 arena
+ */
+static void arena_checkheap(int lineno)
+{
+    lineno = lineno;
+    dbg_printf("call by line-%d\n", lineno);
 
     /* checking the heap */
 
     /*
      * 检查 block's address alignment
-     * 检查 header 和 footer 是否匹配
+     * 检查 free block 的 header 和 footer 是否匹配
+     * 检查 PREV_ALLOC 位是否正确
      * 检查是否存在连续的 free block
      */
     // 从序言块后一个节点开始往后遍历
-    char *bp = NEXT_BLKP(heap_listp);
+    char *bp = NEXT_BLKP(cur_arena->heap_listp);
     size_t is_pre_alloc = 1;
     size_t free_block_num = 0;
     // 只有结尾块的 size 是 0
@@ -753,8 +2613,15 @@ void mm_checkheap(int verbose)
             exit(127);
         }
 
-        // 检查 header 和 footer 是否匹配
-        if (GET(HDRP(bp)) != GET(FTRP(bp)))
+        // 检查 free block 的 header 和 footer 是否匹配，已分配的 block 没有 footer
+        if (!GET_ALLOC(HDRP(bp)) && GET(FTRP(bp)) != PACK(GET_SIZE(HDRP(bp)), 0x0))
+        {
+            dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+            exit(127);
+        }
+
+        // 检查 PREV_ALLOC 位
+        if (!GET_PREV_ALLOC(HDRP(bp)) != !is_pre_alloc)
         {
             dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
             exit(127);
@@ -778,33 +2645,33 @@ void mm_checkheap(int verbose)
 
     //检查 epilogue 和 prologue
     // 退出 while 循环后 bp 指向了结尾块
-    if (GET(HDRP(bp)) != 0x1)
+    if (GET(HDRP(bp)) != PACK(0, (is_pre_alloc ? PREV_ALLOC : 0) | 0x1))
     {
         dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
         exit(127);
     }
 
-#define PROLOGUE_SIZE (2 * SIZE_T_SIZE)
-    if (GET(HDRP(heap_listp)) != PACK(PROLOGUE_SIZE, 0x1))
+#define PROLOGUE_SIZE (2 * WSIZE)
+    if (GET(HDRP(cur_arena->heap_listp)) != PACK(PROLOGUE_SIZE, 0x1))
     {
         dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
         exit(127);
     }
-    if (GET(FTRP(heap_listp)) != PACK(PROLOGUE_SIZE, 0x1))
+    if (GET(FTRP(cur_arena->heap_listp)) != PACK(PROLOGUE_SIZE, 0x1))
     {
         dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
         exit(127);
     }
 
-    //检查堆的边界
-    if (heap_listp < (char *)mem_heap_lo())
+    //检查 arena 的边界
+    if (cur_arena->heap_listp < (char *)mem_arena_lo(cur_arena->index))
     {
         dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
         exit(127);
     }
 
     // 不清楚为什么 mem_heap_hi() 的实现减去了 1
-    if (bp > (char *)mem_heap_hi() + 1)
+    if (bp > (char *)mem_arena_hi(cur_arena->index) + 1)
     {
         dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
         exit(127);
@@ -813,10 +2680,28 @@ void mm_checkheap(int verbose)
     /* checking the free list */
     // pred/succ 是连续的， A's next is B, then B's pred must be A
     // 分离空闲链表中，各个 free block size 在该链表的范围之内
-    size_t *entry_listp = segregated_free_listp;
+    uint32_t *entry_listp = SEGREGATED_ENTRY(0);
     // 外循环遍历分离空闲链表的所有入口
-    while (entry_listp < segregated_free_listp + SEGREGATED_FREE_LIST_ENTRY_SIZE)
+    while (entry_listp < SEGREGATED_ENTRY(SEGREGATED_FREE_LIST_NUM))
     {
+        // 位图和空闲链表是否为空一致
+        size_t index = (entry_listp - SEGREGATED_ENTRY(0)) / SEGREGATED_FREE_LIST_ENTRY_STEP;
+        if (!BITMAP_TEST(index) != (SUCC_BLKP(entry_listp) == NULL))
+        {
+            dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+            exit(127);
+        }
+
+        // 最后一组是 AVL 树
+        if (index == TREE_CLASS)
+        {
+            char   *prev  = NULL;
+            size_t height = 0;
+            free_block_num -= tree_checkheap(TREE_ROOT, &prev, &height);
+            entry_listp += SEGREGATED_FREE_LIST_ENTRY_STEP;
+            continue;
+        }
+
         // 内循环遍历单个空闲链表
         char *pred = (char *)entry_listp;
         char *succ = SUCC_BLKP(pred);
@@ -828,6 +2713,13 @@ void mm_checkheap(int verbose)
                 dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
                 exit(127);
             }
+#ifdef SIZE_CLASS_PROFILE
+            if (!class_contains(index, size))
+            {
+                dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+                exit(127);
+            }
+#endif
 
             if (PRED_BLKP(succ) != pred)
             {
@@ -846,8 +2738,8 @@ void mm_checkheap(int verbose)
                 free_block_num--;
             }
 
-            // 所有的空闲链表都在 mem_heap_lo() 和 mem_heap_hi() 之间
-            if (succ < (char *)mem_heap_lo() || succ > (char *)mem_heap_hi())
+            // 所有的空闲链表都在 arena 之内
+            if (succ < (char *)mem_arena_lo(cur_arena->index) || succ > (char *)mem_arena_hi(cur_arena->index))
             {
                 dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
                 exit(127);
@@ -867,4 +2759,220 @@ void mm_checkheap(int verbose)
         dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
         exit(127);
     }
+
+#ifdef SLAB_FRONTEND
+    slab_checkheap();
+#endif
+#ifdef DEFERRED_COALESCE
+    fastbin_checkheap();
+#endif
+}
+
+/*
+ * 中序遍历检查 AVL 树，返回树中 block 的个数，通过 height 返回树的高度
+ * 1. block 在 arena 之内，是 free 的，属于最后一组
+ * 1. 中序遍历时 prev 是前一个 block ，(size, 地址) 严格递增
+ * 1. 保存的高度正确，左右子树的高度差不超过 1
+ */
+static size_t tree_checkheap(char *bp, char **prev, size_t *height)
+{
+    if (bp == NULL)
+    {
+        *height = 0;
+        return 0;
+    }
+
+    if (bp < (char *)mem_arena_lo(cur_arena->index) || bp > (char *)mem_arena_hi(cur_arena->index))
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        exit(127);
+    }
+
+    if (GET_ALLOC(HDRP(bp)) || size_to_class(GET_SIZE(HDRP(bp))) != TREE_CLASS)
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        exit(127);
+    }
+#ifdef SIZE_CLASS_PROFILE
+    if (!class_contains(TREE_CLASS, GET_SIZE(HDRP(bp))))
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        exit(127);
+    }
+#endif
+
+    size_t lheight = 0;
+    size_t rheight = 0;
+    size_t num     = tree_checkheap(TREE_LEFT(bp), prev, &lheight);
+
+    if (*prev != NULL && !TREE_LESS(*prev, bp))
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        exit(127);
+    }
+    *prev = bp;
+
+    num += tree_checkheap(TREE_RIGHT(bp), prev, &rheight) + 1;
+
+    *height = MAX(lheight, rheight) + 1;
+    if (TREE_HEIGHT(bp) != *height || lheight > rheight + 1 || rheight > lheight + 1)
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        exit(127);
+    }
+
+    return num;
+}
+
+#ifdef HEAP_CHECK
+/*
+ * 对一个 block 做 O(1) 的局部检查，只访问 bp 、前后相邻的 block 和链表中相邻的节点
+ * 1. 地址对齐，在 arena 之内，size 满足对齐和最小块的要求
+ * 1. 后一个 block 的 PREV_ALLOC 位和 bp 的 allocated bit 一致
+ * 1. 前一个 block 是 free 的时候，其 header 和 footer 一致，且 bp 是已分配的
+ * 1. free block 的 header 和 footer 一致，后一个 block 是已分配的（已经合并），位图中这一组非空
+ * 1. 链表中的 free block ：前驱的后继和后继的前驱都是 bp ，相邻节点属于同一组，按 size 升序
+ * 1. AVL 树中的 free block ：左右子树属于最后一组，(size, 地址) 的顺序、高度和平衡都正确
+ */
+static void arena_check_block(char *bp)
+{
+    char   *lo   = (char *)mem_arena_lo(cur_arena->index);
+    char   *hi   = (char *)mem_arena_hi(cur_arena->index);
+    size_t size  = GET_SIZE(HDRP(bp));
+    char   *next = NEXT_BLKP(bp);
+
+    if (((size_t)bp % ALIGNMENT) != 0 || bp <= cur_arena->heap_listp || bp > hi)
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        exit(127);
+    }
+
+    if (size < MIN_BLOCK_SIZE || (size % ALIGNMENT) != 0 || next > hi + 1)
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        exit(127);
+    }
+
+    // 后一个 block 的 PREV_ALLOC 位
+    if (!GET_PREV_ALLOC(HDRP(next)) != !GET_ALLOC(HDRP(bp)))
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        exit(127);
+    }
+
+    // 前一个 block 是 free 的，只有这时才能使用 PREV_BLKP
+    if (!GET_PREV_ALLOC(HDRP(bp)))
+    {
+        char *prev = PREV_BLKP(bp);
+        if (!GET_ALLOC(HDRP(bp)) || prev <= cur_arena->heap_listp ||
+            GET(HDRP(prev)) != (GET(FTRP(prev)) | PREV_ALLOC) || NEXT_BLKP(prev) != bp)
+        {
+            dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+            exit(127);
+        }
+    }
+
+    if (GET_ALLOC(HDRP(bp)))
+    {
+        return;
+    }
+
+    // free block ：header footer 一致，后面的 block 已经合并
+    size_t index = size_to_class(size);
+    if (GET(FTRP(bp)) != PACK(size, 0x0) || !GET_ALLOC(HDRP(next)) || !BITMAP_TEST(index))
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        exit(127);
+    }
+
+    if (index == TREE_CLASS)
+    {
+        char *left  = TREE_LEFT(bp);
+        char *right = TREE_RIGHT(bp);
+
+        if ((left != NULL && (left < lo || left > hi || GET_ALLOC(HDRP(left)) ||
+                              size_to_class(GET_SIZE(HDRP(left))) != TREE_CLASS || !TREE_LESS(left, bp))) ||
+            (right != NULL && (right < lo || right > hi || GET_ALLOC(HDRP(right)) ||
+                               size_to_class(GET_SIZE(HDRP(right))) != TREE_CLASS || !TREE_LESS(bp, right))))
+        {
+            dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+            exit(127);
+        }
+
+        size_t lheight = TREE_HEIGHT(left);
+        size_t rheight = TREE_HEIGHT(right);
+        if (TREE_HEIGHT(bp) != MAX(lheight, rheight) + 1 || lheight > rheight + 1 || rheight > lheight + 1)
+        {
+            dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+            exit(127);
+        }
+        return;
+    }
+
+    // 前驱是这一组的入口，或者是同一组中不大于 bp 的 free block
+    char *pred = PRED_BLKP(bp);
+    char *succ = SUCC_BLKP(bp);
+    if (pred == NULL || SUCC_BLKP(pred) != bp)
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        exit(127);
+    }
+    if (pred != (char *)SEGREGATED_ENTRY(index) &&
+        (pred < lo || pred > hi || GET_ALLOC(HDRP(pred)) ||
+         size_to_class(GET_SIZE(HDRP(pred))) != index || GET_SIZE(HDRP(pred)) > size))
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        exit(127);
+    }
+
+    if (succ != NULL &&
+        (succ < lo || succ > hi || PRED_BLKP(succ) != bp || GET_ALLOC(HDRP(succ)) ||
+         size_to_class(GET_SIZE(HDRP(succ))) != index || GET_SIZE(HDRP(succ)) < size))
+    {
+        dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+        exit(127);
+    }
+}
+
+/*
+ * 每次 malloc/free/realloc 结束时调用，bp 是这次操作涉及的 block ，可以为 NULL
+ * 1. 检查 bp ，slab 的 slot 没有 header ，不检查
+ * 1. 从游标开始检查 CHECK_SLICE 个 block ，遇到结尾块时检查结尾块，游标回到第一个 block
+ */
+static void arena_check_step(void *bp)
+{
+#ifdef SLAB_FRONTEND
+    if (bp != NULL && !is_slab_ptr(bp))
+#else
+    if (bp != NULL)
+#endif
+    {
+        arena_check_block(bp);
+    }
+
+    char *cursor = cur_arena->check_cursor;
+    if (cursor == NULL)
+    {
+        cursor = NEXT_BLKP(cur_arena->heap_listp);
+    }
+
+    for (int i = 0; i < CHECK_SLICE && GET_SIZE(HDRP(cursor)) != 0; i++)
+    {
+        arena_check_block(cursor);
+        cursor = NEXT_BLKP(cursor);
+
+        // 结尾块，下一次从堆的开始检查
+        if (GET_SIZE(HDRP(cursor)) == 0)
+        {
+            if (!GET_ALLOC(HDRP(cursor)) || cursor > (char *)mem_arena_hi(cur_arena->index) + 1)
+            {
+                dbg_printf("%s-%s-%d\n", __FILE__, __func__, __LINE__);
+                exit(127);
+            }
+            cursor = NEXT_BLKP(cur_arena->heap_listp);
+        }
+    }
+
+    cur_arena->check_cursor = cursor;
 }
+#endif /* HEAP_CHECK */
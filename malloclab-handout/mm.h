@@ -23,3 +23,26 @@ extern int mm_init(void);
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);
+
+/* Allocator statistics, filled in by mm_stats().  The counters are
+   cumulative since the last mm_init; the byte counts are a snapshot. */
+#define MM_STATS_CLASS_MAX 64
+
+typedef struct {
+	unsigned long malloc_calls;
+	unsigned long free_calls;
+	unsigned long realloc_calls;
+	unsigned long extend_calls;  /* times the heap was grown */
+	unsigned long splits;        /* free blocks split by an allocation */
+	unsigned long coalesces;     /* merges of a free block with a neighbour */
+	unsigned long fit_calls;     /* free list searches */
+	unsigned long fit_steps;     /* free blocks visited by the searches */
+	size_t heap_bytes;           /* bytes obtained from memlib */
+	size_t in_use_bytes;         /* heap_bytes not in free blocks */
+	size_t largest_free;         /* size of the largest free block */
+	int class_num;               /* number of size classes below */
+	unsigned long class_free_blocks[MM_STATS_CLASS_MAX];
+	size_t class_free_bytes[MM_STATS_CLASS_MAX];
+} mm_stats_t;
+
+extern void mm_stats(mm_stats_t *stats);
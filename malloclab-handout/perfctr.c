@@ -0,0 +1,103 @@
+/*
+ * perfctr.c - Count hardware events with perf_event_open
+ *
+ * Each event has a counter of its own rather than one group, so that
+ * a CPU or VM that lacks one event (often the cache events) still
+ * counts the others. The counters only count user-mode events of the
+ * calling thread.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perfctr.h"
+
+static int fds[PERFCTR_NUM] = { -1, -1, -1, -1 };
+static pid_t owner = 0;         /* process that opened fds */
+
+static const struct {
+    const char *name;
+    unsigned type;
+    unsigned long long config;
+} events[PERFCTR_NUM] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "L1D-misses", PERF_TYPE_HW_CACHE,
+      PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+
+/*
+ * perfctr_init - Open a disabled counter for every event. The
+ *     counters of a parent process count the parent only, so a forked
+ *     child opens its own.
+ */
+int perfctr_init(void)
+{
+    struct perf_event_attr attr;
+    int i, n = 0;
+
+    if (owner == getpid()) {
+        for (i = 0; i < PERFCTR_NUM; i++)
+            n += fds[i] >= 0;
+        return n;
+    }
+    owner = getpid();
+
+    for (i = 0; i < PERFCTR_NUM; i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds[i] >= 0)
+            n++;
+    }
+    return n;
+}
+
+/*
+ * perfctr_start - Zero and enable the open counters
+ */
+void perfctr_start(void)
+{
+    int i;
+
+    for (i = 0; i < PERFCTR_NUM; i++) {
+        if (fds[i] < 0)
+            continue;
+        ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+/*
+ * perfctr_stop - Disable the counters and read them into c
+ */
+void perfctr_stop(perfctr_t *c)
+{
+    int i;
+
+    for (i = 0; i < PERFCTR_NUM; i++)
+        if (fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+    for (i = 0; i < PERFCTR_NUM; i++) {
+        c->count[i] = 0;
+        c->valid[i] = fds[i] >= 0 &&
+            read(fds[i], &c->count[i], sizeof(c->count[i])) == sizeof(c->count[i]);
+    }
+}
+
+const char *perfctr_name(int i)
+{
+    return events[i].name;
+}
@@ -0,0 +1,36 @@
+#ifndef __PERFCTR_H_
+#define __PERFCTR_H_
+
+/*
+ * perfctr.h - Hardware event counters of the calling thread, read
+ *     with the Linux perf_event_open system call
+ */
+
+/* The events, in the order of perfctr_t.count */
+enum {
+    PERFCTR_CYCLES,       /* CPU cycles */
+    PERFCTR_INSTRUCTIONS, /* instructions retired */
+    PERFCTR_CACHE_MISSES, /* last-level cache misses */
+    PERFCTR_L1D_MISSES,   /* L1 data cache read misses */
+    PERFCTR_NUM
+};
+
+typedef struct {
+    int valid[PERFCTR_NUM];                /* 0 if the event is not available */
+    unsigned long long count[PERFCTR_NUM];
+} perfctr_t;
+
+/* Open the counters. Return the number of events that are available;
+   a kernel or VM without them gives 0, and the rest still works */
+int perfctr_init(void);
+
+/* Reset the counters and start counting */
+void perfctr_start(void);
+
+/* Stop counting and read the counts since perfctr_start */
+void perfctr_stop(perfctr_t *c);
+
+/* Name of event i, for reports */
+const char *perfctr_name(int i);
+
+#endif /* __PERFCTR_H_ */
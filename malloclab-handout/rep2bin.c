@@ -0,0 +1,85 @@
+/*
+ * rep2bin.c - Convert a text trace (.rep) into the binary trace format
+ *     that mdriver can mmap instead of parsing (see trace.h)
+ *
+ * usage: rep2bin <tracefile.rep> <tracefile.bin>
+ *
+ * The text is parsed exactly like read_trace in mdriver.c does it, so
+ * both formats of a trace replay the same requests.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+static void die(const char *msg, const char *filename)
+{
+	fprintf(stderr, "rep2bin: %s %s\n", msg, filename);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	FILE *in, *out;
+	trace_hdr_t hdr;
+	traceop_t *ops;
+	char type[1024];
+	int index = 0, size = 0;
+	int max_index = 0;
+	int op_index = 0;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <tracefile.rep> <tracefile.bin>\n", argv[0]);
+		exit(1);
+	}
+
+	if ((in = fopen(argv[1], "r")) == NULL)
+		die("can't open", argv[1]);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+	hdr.op_size = sizeof(traceop_t);
+	if (fscanf(in, "%d %d %d %d", &hdr.weight, &hdr.num_ids,
+				&hdr.num_ops, &hdr.ignore_ranges) != 4 || hdr.num_ops < 0)
+		die("bad header in", argv[1]);
+
+	if ((ops = calloc(hdr.num_ops ? hdr.num_ops : 1, sizeof(traceop_t))) == NULL)
+		die("out of memory for", argv[1]);
+
+	/* Like mdriver, a line without a size reuses the previous size */
+	while (op_index < hdr.num_ops && fscanf(in, "%s", type) != EOF) {
+		switch (type[0]) {
+			case 'a':
+			case 'r':
+				fscanf(in, "%u %u", &index, &size);
+				ops[op_index].type = type[0] == 'a' ? ALLOC : REALLOC;
+				ops[op_index].index = index;
+				ops[op_index].size = size;
+				max_index = (index > max_index) ? index : max_index;
+				break;
+			case 'f':
+				fscanf(in, "%ud", &index);
+				ops[op_index].type = FREE;
+				ops[op_index].index = index;
+				break;
+			default:
+				die("bogus request type in", argv[1]);
+		}
+		op_index++;
+	}
+	fclose(in);
+
+	if (op_index != hdr.num_ops || max_index != hdr.num_ids - 1)
+		die("header does not match the requests in", argv[1]);
+
+	if ((out = fopen(argv[2], "w")) == NULL)
+		die("can't create", argv[2]);
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+			fwrite(ops, sizeof(traceop_t), hdr.num_ops, out) != (size_t)hdr.num_ops ||
+			fclose(out) != 0)
+		die("can't write", argv[2]);
+
+	free(ops);
+	return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+/*
+ * trace.h - The trace records shared by mdriver and rep2bin
+ *
+ * A binary trace is a trace_hdr_t followed by num_ops traceop_t
+ * records, laid out exactly as they are in memory on the machine that
+ * wrote them, so mdriver can mmap the file and use the records in
+ * place. rep2bin converts a text .rep file into this format.
+ */
+
+#include <stddef.h>
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+	enum { ALLOC, FREE, REALLOC } type; /* type of request */
+	int index;                        /* index for free() to use later */
+	size_t size;                      /* byte size of alloc/realloc request */
+} traceop_t;
+
+/* First bytes of a binary trace; a text trace starts with a digit */
+#define TRACE_MAGIC     "MMTRACE1"
+#define TRACE_MAGIC_LEN 8
+
+/* Header of a binary trace, the same fields as the text header */
+typedef struct {
+	char magic[TRACE_MAGIC_LEN]; /* TRACE_MAGIC */
+	int op_size;         /* sizeof(traceop_t) of the writer */
+	int weight;          /* weight for this trace (0 or 1) */
+	int num_ids;         /* number of alloc/realloc ids */
+	int num_ops;         /* number of requests */
+	int ignore_ranges;   /* 4th line of the text header */
+	int reserved;        /* keeps the records 8-byte aligned */
+} trace_hdr_t;
+
+#endif /* __TRACE_H_ */
@@ -0,0 +1,493 @@
+/*
+ * tracegen.c - Synthesize a trace from size, lifetime and realloc models
+ *
+ * usage: tracegen [options] <out.rep | out.bin>
+ *
+ * The trace is a sequence of phases. The options before each -n set
+ * the models of the phase that -n ends; later phases inherit every
+ * option that they do not set again:
+ *
+ *   -n <count>   end a phase of <count> malloc and realloc requests
+ *   -S <dist>    request sizes in bytes (default exp:64)
+ *   -L <dist>    lifetimes, counted in malloc and realloc requests
+ *                (default exp:1000); "inf" lives until the end
+ *   -r <prob>    a request is a realloc of a random live block with
+ *                this probability (default 0)
+ *   -G <growth>  new size of a realloc: mul:<factor> or add:<dist>
+ *                (default mul:1.5)
+ *   -M <bytes>   largest request size (default 1048576)
+ *
+ * and, for the whole trace:
+ *
+ *   -s <seed>    random seed (default 1)
+ *   -w <weight>  weight in the trace header (default 1)
+ *   -b           write the binary format of trace.h instead of text
+ *
+ * A distribution is one of const:<n>, uniform:<lo>:<hi>, exp:<mean>,
+ * lognormal:<median>:<sigma>, pareto:<min>:<alpha>, pow2:<lo>:<hi>
+ * or inf, or a mixture of them with weights, such as
+ * "0.9*exp:48+0.1*uniform:4096:65536".
+ *
+ * A block is freed once its lifetime has passed; the blocks still
+ * live after the last phase are freed at the end, so the trace is
+ * balanced. The ids, requests and peak live bytes go to stderr.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define MAX_TERMS 8             /* components of a mixture */
+#define HEADER_WIDTH 10         /* text header fields are rewritten in place */
+
+/* One component of a distribution */
+typedef struct {
+	enum { D_CONST, D_UNIFORM, D_EXP, D_LOGNORMAL, D_PARETO, D_POW2, D_INF } kind;
+	double weight;              /* cumulative weight, up to 1 */
+	double a, b;                /* parameters */
+} term_t;
+
+typedef struct {
+	int nterms;
+	term_t terms[MAX_TERMS];
+} dist_t;
+
+/* The models of one phase */
+typedef struct {
+	dist_t size;
+	dist_t life;
+	double realloc_prob;
+	int grow_add;               /* add grow_dist instead of multiplying */
+	double grow_factor;
+	dist_t grow_dist;
+	size_t max_size;
+} phase_t;
+
+/* A live block, kept in a min-heap on its death time */
+typedef struct {
+	uint64_t death;
+	int id;
+} death_t;
+
+static uint64_t rng_state;
+
+static death_t *heap;           /* pending frees */
+static int heap_len, heap_cap;
+static int *live;               /* ids of the live blocks */
+static int *live_pos;           /* position of each id in live, by id */
+static size_t *sizes;           /* current size of each id */
+static int live_len, num_ids, ids_cap;
+
+static FILE *out;
+static int binary;
+static int num_ops;
+static size_t live_bytes, peak_bytes;
+
+static void die(const char *msg, const char *arg)
+{
+	fprintf(stderr, "tracegen: %s %s\n", msg, arg);
+	exit(1);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: tracegen [-s seed] [-w weight] [-b] "
+			"{[-S dist] [-L dist] [-r prob] [-G growth] [-M bytes] -n count}... "
+			"<out.rep | out.bin>\n");
+	exit(1);
+}
+
+/*
+ * The random number generator: xorshift64*, so that a seed gives the
+ * same trace everywhere
+ */
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+/*
+ * rng_seed - Start the generator from seed, mixed with one splitmix64
+ *     step so that every seed gives a different state; only the state 0,
+ *     which xorshift never leaves, is replaced by a fixed one
+ */
+static void rng_seed(uint64_t seed)
+{
+	seed += 0x9e3779b97f4a7c15ULL;
+	seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+	rng_state = seed ^ (seed >> 31);
+	if (rng_state == 0)
+		rng_state = 0x9e3779b97f4a7c15ULL;
+}
+
+/* uniform in (0, 1) */
+static double rng_unit(void)
+{
+	return ((rng() >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static double rng_normal(void)
+{
+	return sqrt(-2 * log(rng_unit())) * cos(2 * M_PI * rng_unit());
+}
+
+/*
+ * parse_dist - Parse a distribution such as "0.7*exp:64+0.3*const:8"
+ */
+static void parse_dist(dist_t *d, const char *spec)
+{
+	char buf[1024], *term, *save, *colon;
+	double total = 0;
+	int i;
+
+	if (strlen(spec) >= sizeof(buf))
+		die("distribution too long:", spec);
+	strcpy(buf, spec);
+	d->nterms = 0;
+	for (term = strtok_r(buf, "+", &save); term; term = strtok_r(NULL, "+", &save)) {
+		term_t *t = &d->terms[d->nterms];
+		char *star = strchr(term, '*');
+
+		if (d->nterms == MAX_TERMS)
+			die("too many terms in", spec);
+		t->weight = 1;
+		if (star) {
+			*star = '\0';
+			t->weight = atof(term);
+			term = star + 1;
+		}
+		if (t->weight <= 0)
+			die("bad weight in", spec);
+		t->a = t->b = 0;
+		if ((colon = strchr(term, ':')) != NULL) {
+			*colon = '\0';
+			if (sscanf(colon + 1, "%lf:%lf", &t->a, &t->b) < 1)
+				die("bad parameters in", spec);
+		}
+
+		if (!strcmp(term, "const"))
+			t->kind = D_CONST;
+		else if (!strcmp(term, "uniform") && t->b >= t->a)
+			t->kind = D_UNIFORM;
+		else if (!strcmp(term, "exp") && t->a > 0)
+			t->kind = D_EXP;
+		else if (!strcmp(term, "lognormal") && t->a > 0)
+			t->kind = D_LOGNORMAL;
+		else if (!strcmp(term, "pareto") && t->a > 0 && t->b > 0)
+			t->kind = D_PARETO;
+		else if (!strcmp(term, "pow2") && t->a >= 1 && ceil(log2(t->a)) <= floor(log2(t->b)))
+			t->kind = D_POW2;
+		else if (!strcmp(term, "inf"))
+			t->kind = D_INF;
+		else
+			die("bad distribution", spec);
+		total += t->weight;
+		d->nterms++;
+	}
+	if (d->nterms == 0)
+		die("empty distribution", spec);
+
+	/* make the weights cumulative, so sampling picks the first above u */
+	for (i = 0; i < d->nterms; i++)
+		d->terms[i].weight = (i ? d->terms[i - 1].weight : 0) + d->terms[i].weight / total;
+	d->terms[d->nterms - 1].weight = 1;
+}
+
+/*
+ * sample - Draw from a distribution; returns -1 for inf
+ */
+static double sample(const dist_t *d)
+{
+	const term_t *t = d->terms;
+	double u = rng_unit();
+	int lo, hi;
+
+	while (u > t->weight)
+		t++;
+
+	switch (t->kind) {
+		case D_CONST:
+			return t->a;
+		case D_UNIFORM:
+			return t->a + (t->b - t->a) * rng_unit();
+		case D_EXP:
+			return -t->a * log(rng_unit());
+		case D_LOGNORMAL:
+			return t->a * exp(t->b * rng_normal());
+		case D_PARETO:
+			return t->a / pow(rng_unit(), 1 / t->b);
+		case D_POW2:
+			lo = (int)ceil(log2(t->a));
+			hi = (int)floor(log2(t->b));
+			return ldexp(1, lo + (int)(rng() % (uint64_t)(hi - lo + 1)));
+		default:
+			return -1;
+	}
+}
+
+/* A size between 1 and max_size */
+static size_t sample_size(const dist_t *d, size_t max_size)
+{
+	double x = sample(d);
+
+	if (x < 1)
+		return 1;
+	return x > (double)max_size ? max_size : (size_t)x;
+}
+
+/*
+ * The trace records. The text format writes them as they come; the
+ * counts in either header are filled in by finish_trace.
+ */
+static void emit(int type, int index, size_t size)
+{
+	num_ops++;
+	if (binary) {
+		traceop_t op;
+
+		memset(&op, 0, sizeof(op));
+		op.type = type;
+		op.index = index;
+		op.size = size;
+		fwrite(&op, sizeof(op), 1, out);
+	} else if (type == FREE) {
+		fprintf(out, "f %d\n", index);
+	} else {
+		fprintf(out, "%c %d %lu\n", type == ALLOC ? 'a' : 'r', index,
+				(unsigned long)size);
+	}
+}
+
+static void write_header(int weight)
+{
+	rewind(out);
+	if (binary) {
+		trace_hdr_t hdr;
+
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+		hdr.op_size = sizeof(traceop_t);
+		hdr.weight = weight;
+		hdr.num_ids = num_ids;
+		hdr.num_ops = num_ops;
+		fwrite(&hdr, sizeof(hdr), 1, out);
+	} else {
+		fprintf(out, "%*d\n%*d\n%*d\n%*d\n", HEADER_WIDTH, weight,
+				HEADER_WIDTH, num_ids, HEADER_WIDTH, num_ops, HEADER_WIDTH, 0);
+	}
+}
+
+/*
+ * The pending frees: a binary min-heap on the death time
+ */
+static void heap_push(uint64_t death, int id)
+{
+	int i;
+
+	if (heap_len == heap_cap) {
+		heap_cap = heap_cap ? 2 * heap_cap : 1024;
+		if ((heap = realloc(heap, heap_cap * sizeof(*heap))) == NULL)
+			die("out of memory", "");
+	}
+	for (i = heap_len++; i > 0 && heap[(i - 1) / 2].death > death; i = (i - 1) / 2)
+		heap[i] = heap[(i - 1) / 2];
+	heap[i].death = death;
+	heap[i].id = id;
+}
+
+static death_t heap_pop(void)
+{
+	death_t top = heap[0], last = heap[--heap_len];
+	int i = 0, child;
+
+	while ((child = 2 * i + 1) < heap_len) {
+		if (child + 1 < heap_len && heap[child + 1].death < heap[child].death)
+			child++;
+		if (last.death <= heap[child].death)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+	return top;
+}
+
+/*
+ * Allocate a new id and make it live
+ */
+static void do_alloc(size_t size, uint64_t death)
+{
+	int id = num_ids++;
+
+	if (id == ids_cap) {
+		ids_cap = ids_cap ? 2 * ids_cap : 1024;
+		if ((sizes = realloc(sizes, ids_cap * sizeof(*sizes))) == NULL ||
+				(live_pos = realloc(live_pos, ids_cap * sizeof(*live_pos))) == NULL ||
+				(live = realloc(live, ids_cap * sizeof(*live))) == NULL)
+			die("out of memory", "");
+	}
+	sizes[id] = size;
+	live_pos[id] = live_len;
+	live[live_len++] = id;
+	heap_push(death, id);
+
+	emit(ALLOC, id, size);
+	live_bytes += size;
+	if (live_bytes > peak_bytes)
+		peak_bytes = live_bytes;
+}
+
+static void do_free(int id)
+{
+	int last = live[--live_len];
+
+	live[live_pos[id]] = last;
+	live_pos[last] = live_pos[id];
+	live_bytes -= sizes[id];
+	emit(FREE, id, 0);
+}
+
+static void do_realloc(const phase_t *ph)
+{
+	int id = live[rng() % (uint64_t)live_len];
+	size_t size;
+
+	if (ph->grow_add)
+		size = sizes[id] + sample_size(&ph->grow_dist, ph->max_size);
+	else
+		size = (size_t)(sizes[id] * ph->grow_factor);
+	if (size < 1)
+		size = 1;
+	if (size > ph->max_size)
+		size = ph->max_size;
+
+	emit(REALLOC, id, size);
+	live_bytes += size - sizes[id];
+	sizes[id] = size;
+	if (live_bytes > peak_bytes)
+		peak_bytes = live_bytes;
+}
+
+/*
+ * run_phase - Issue count malloc and realloc requests; clock counts
+ *     them over the whole trace and is what lifetimes are measured in
+ */
+static void run_phase(const phase_t *ph, int count, uint64_t *clock)
+{
+	int i;
+
+	for (i = 0; i < count; i++, (*clock)++) {
+		while (heap_len > 0 && heap[0].death <= *clock)
+			do_free(heap_pop().id);
+
+		if (live_len > 0 && ph->realloc_prob > 0 && rng_unit() < ph->realloc_prob) {
+			do_realloc(ph);
+		} else {
+			double life = sample(&ph->life);
+			uint64_t death = life < 0 ? UINT64_MAX : *clock + 1 + (uint64_t)life;
+
+			do_alloc(sample_size(&ph->size, ph->max_size), death);
+		}
+	}
+}
+
+static void parse_growth(phase_t *ph, const char *spec)
+{
+	if (!strncmp(spec, "mul:", 4) && (ph->grow_factor = atof(spec + 4)) > 0) {
+		ph->grow_add = 0;
+	} else if (!strncmp(spec, "add:", 4)) {
+		ph->grow_add = 1;
+		parse_dist(&ph->grow_dist, spec + 4);
+	} else {
+		die("bad growth", spec);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	phase_t ph;
+	uint64_t clock = 0;
+	int weight = 1;
+	int phases = 0;
+	int c;
+
+	memset(&ph, 0, sizeof(ph));
+	parse_dist(&ph.size, "exp:64");
+	parse_dist(&ph.life, "exp:1000");
+	parse_growth(&ph, "mul:1.5");
+	ph.max_size = 1 << 20;
+	rng_seed(1);
+
+	/* First pass: the options for the whole trace */
+	while ((c = getopt(argc, argv, "n:S:L:r:G:M:s:w:b")) != EOF) {
+		switch (c) {
+			case 's':
+				rng_seed(strtoull(optarg, NULL, 0));
+				break;
+			case 'w':
+				weight = atoi(optarg);
+				break;
+			case 'b':
+				binary = 1;
+				break;
+			case '?':
+				usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+	if ((out = fopen(argv[optind], "w")) == NULL)
+		die("can't create", argv[optind]);
+	write_header(weight);
+
+	/* Second pass: the phases, each run as soon as its -n is seen */
+	optind = 0;
+	while ((c = getopt(argc, argv, "n:S:L:r:G:M:s:w:b")) != EOF) {
+		switch (c) {
+			case 'n':
+				if (atoi(optarg) < 1)
+					die("bad count", optarg);
+				run_phase(&ph, atoi(optarg), &clock);
+				phases++;
+				break;
+			case 'S':
+				parse_dist(&ph.size, optarg);
+				break;
+			case 'L':
+				parse_dist(&ph.life, optarg);
+				break;
+			case 'r':
+				ph.realloc_prob = atof(optarg);
+				break;
+			case 'G':
+				parse_growth(&ph, optarg);
+				break;
+			case 'M':
+				if ((ph.max_size = strtoul(optarg, NULL, 0)) < 1)
+					die("bad size", optarg);
+				break;
+		}
+	}
+	if (phases == 0)
+		usage();
+
+	/* free what is left in the order the blocks would have died */
+	while (heap_len > 0)
+		do_free(heap_pop().id);
+
+	write_header(weight);
+	if (fclose(out) != 0)
+		die("can't write", argv[argc - 1]);
+
+	fprintf(stderr, "%s: %d ids, %d requests, peak live %lu bytes\n",
+			argv[argc - 1], num_ids, num_ops, (unsigned long)peak_bytes);
+	return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * capture-test.c - A multi-threaded program for checking get-trace.so.
+ * The threads malloc, realloc and free blocks through one shared array
+ * of slots, so a block is often freed or realloc'ed by another thread
+ * than the one that allocated it and addresses move between threads.
+ * "make check-capture" records it and converts the recording.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define THREADS 4
+#define SLOTS   1024
+#define OPS     200000
+
+static void *slots[SLOTS];
+
+static void *worker(void *arg) {
+    unsigned seed = (unsigned)(size_t)arg;
+    void *p, *q;
+    int i;
+
+    for(i = 0; i < OPS; i++) {
+        unsigned r = rand_r(&seed);
+        int slot = r % SLOTS;
+        size_t size = 1 + (r >> 10) % 512;
+
+        p = __atomic_exchange_n(&slots[slot], NULL, __ATOMIC_ACQ_REL);
+        if(p == NULL) {
+            p = malloc(size);
+        } else if((r >> 20) % 3 == 0) {
+            free(p);
+            continue;
+        } else {
+            q = realloc(p, size * ((r >> 22) % 4 + 1));
+            if(q == NULL) {
+                free(p);
+                continue;
+            }
+            p = q;
+        }
+        q = __atomic_exchange_n(&slots[slot], p, __ATOMIC_ACQ_REL);
+        free(q);
+    }
+    return NULL;
+}
+
+int main(void) {
+    pthread_t tid[THREADS];
+    long i;
+
+    for(i = 0; i < THREADS; i++) {
+        pthread_create(&tid[i], NULL, worker, (void *)(i + 1));
+    }
+    for(i = 0; i < THREADS; i++) {
+        pthread_join(tid[i], NULL);
+    }
+    for(i = 0; i < SLOTS; i++) {
+        free(slots[i]);
+    }
+    return 0;
+}
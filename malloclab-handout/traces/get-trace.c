@@ -6,15 +6,42 @@
  *
  * Each pointer is labeled with its address and its PID.
  * A null pointer is labeled just as 0.
+ *
+ * The requests are passed on to the C library's allocator. Each thread
+ * appends its records to a buffer of its own without taking a lock,
+ * and a full buffer goes out in a single write() to a file opened with
+ * O_APPEND, so the output of different threads never mixes within a
+ * record.
+ *
+ * With GENERATE_TRACE_FORMAT=binary, the file is a trace_file_hdr
+ * followed by fixed-size trace_rec records, which also carry a
+ * timestamp, the thread id and the return address of the call.
+ * Otherwise it is the text format below, which has no timestamps, so
+ * the requests of a multi-threaded program come out grouped by thread.
+ * convert-exec-trace-to-rep reads both and sorts binary records by
+ * time.
  */
 
 #define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include <assert.h>
 #include <fcntl.h>
-#include <stdarg.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The C library's allocator, which does the real work */
+extern void *__libc_malloc(size_t sz);
+extern void *__libc_calloc(size_t sz1, size_t sz2);
+extern void *__libc_realloc(void *p, size_t sz);
+extern void __libc_free(void *p);
 
 static char file_prefix[] = ""
 "# Memory trace collected by get-trace.o\n"
@@ -27,157 +54,282 @@ static char file_prefix[] = ""
 "# f p       => free(p);\n"
 "\n";
 
-static double memory[1<<26]; /* a short execution will work */
-static int myheapend = 0;
+/* Binary format: a trace_file_hdr, then one trace_rec per request */
+#define TRACE_REC_MAGIC "MMEXEC1"
+
+typedef struct {
+    char magic[8];              /* TRACE_REC_MAGIC */
+    uint32_t rec_size;          /* sizeof(trace_rec) */
+    uint32_t reserved;
+} trace_file_hdr;
+
+typedef struct {
+    uint64_t time;              /* CLOCK_MONOTONIC, in ns */
+    uint64_t caller;            /* return address of the call */
+    uint64_t ptr;               /* result, or the pointer passed to free */
+    uint64_t oldptr;            /* realloc: the old pointer */
+    uint64_t size;              /* malloc, realloc: size; calloc: nmemb */
+    uint64_t size2;             /* calloc: size */
+    uint32_t pid;
+    uint32_t tid;
+    char type;                  /* 'm', 'c', 'x', 'r' or 'f' */
+    char pad[7];
+} trace_rec;
+
+#define BUFFER_LEN  (1 << 20)   /* bytes per thread */
+#define MAX_REC_LEN 128         /* longest text line or binary record */
 
+/*
+ * Buffers are never freed. A thread that exits flushes its buffer and
+ * leaves it to the next new thread; the exit handler flushes every
+ * buffer on the list.
+ */
+typedef struct trace_buf {
+    struct trace_buf *next;
+    int in_use;
+    size_t len;
+    char data[BUFFER_LEN];
+} trace_buf;
+
+static trace_buf *all_bufs;
+static __thread trace_buf *mybuf;
+static __thread uint32_t mytid;
+static __thread int busy;       /* inside the tracer: don't record */
+
+static int binary = 0;
+static pid_t mypid;
 static int outfd = -1;
+static pthread_key_t buf_key;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_once_t open_once = PTHREAD_ONCE_INIT;
+
+static void open_output(void) {
+    const char *outname;
+    char namebuf[4096];
+    char linkbuf[4096];
+    int trynum = 0;
+    int len;
 
-#define BUFFER_LEN 4000
-typedef char myline[64];
-static myline buffer[BUFFER_LEN];
-static int nbuffered = 0;
-
-static void clear_buffer(void) {
-    int i;
-
-    if(outfd == -1) {
-        const char *outname;
-        char namebuf[4096];
-        char linkbuf[4096];
-        int trynum = 0;
-        int len;
+    outname = getenv("GENERATE_TRACE_OUTPUT");
+    if(!outname) {
+        outname = "/tmp/trace";
+    }
 
-        outname = getenv("GENERATE_TRACE_OUTPUT");
-        if(!outname) {
-            outname = "/tmp/trace";
+    /* get the executable name (on linux <= 2.0 we get the inode number;
+       on other platforms we may just fail) */
+    sprintf(namebuf, "/proc/%u/exe", (unsigned) getpid());
+    len = readlink(namebuf, linkbuf, sizeof(linkbuf) - 1);
+    if(len >= 0) {
+        int i;
+        for(i = 0; i < len; i++) {
+            if(linkbuf[i] == '/') linkbuf[i] = '_';
         }
+        linkbuf[len] = 0;
+        snprintf(namebuf, sizeof(namebuf), "%.2000s.%.2000s", outname, linkbuf);
+    }
 
-        /* get the executable name (on linux <= 2.0 we get the inode number;
-           on other platforms we may just fail) */
-        sprintf(namebuf, "/proc/%u/exe", (unsigned) getpid());
-        len = readlink(namebuf, linkbuf, sizeof(linkbuf));
-        if(len >= 0) {
-            int i;
-            for(i = 0; i < len; i++) {
-                if(linkbuf[i] == '/') linkbuf[i] = '_';
-            }
-            linkbuf[len] = 0;
-            sprintf(namebuf, "%s.%s", outname, linkbuf);
-        }
+    outfd = open(namebuf, O_CREAT | O_EXCL | O_WRONLY | O_APPEND, 0666);
+    if(outfd < 0) {
+        char basename[4096];
+        strcpy(basename, namebuf);
+        do {
+            assert(trynum < 10000);
+            snprintf(namebuf, sizeof(namebuf), "%.4000s.%d", basename, ++trynum);
+            outfd = open(namebuf, O_CREAT | O_EXCL | O_WRONLY | O_APPEND, 0666);
+        } while(outfd < 0);
+    }
+    fcntl(outfd, F_SETFD, 1); /* close-on-exec */
 
-        outfd = open(namebuf, O_CREAT | O_EXCL | O_WRONLY, 0666);
-        if(outfd < 0) {
-            char basename[4096];
-            strcpy(basename, namebuf);
-            do {
-                assert(trynum < 10000);
-                sprintf(namebuf, "%s.%d", basename, ++trynum);
-                outfd = open(namebuf, O_CREAT | O_EXCL | O_WRONLY, 0666);
-            } while(outfd < 0);
-        }
-        fcntl(outfd, F_SETFD, 1); /* close-on-exec */
+    if(binary) {
+        trace_file_hdr hdr;
 
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, TRACE_REC_MAGIC, sizeof(TRACE_REC_MAGIC));
+        hdr.rec_size = sizeof(trace_rec);
+        write(outfd, &hdr, sizeof(hdr));
+    } else {
         write(outfd, file_prefix, strlen(file_prefix));
     }
+}
 
-    for(i = 0; i < nbuffered; i++) {
-        write(outfd, buffer[i], strlen(buffer[i]));
+static void clear_buffer(trace_buf *b) {
+    size_t done = 0;
+    ssize_t n;
+
+    pthread_once(&open_once, open_output);
+    while(done < b->len) {
+        n = write(outfd, b->data + done, b->len - done);
+        if(n <= 0) break;
+        done += n;
     }
-    nbuffered = 0;
+    b->len = 0;
 }
 
-static void clear_buffer_and_close(void) {
-    clear_buffer();
-    close(outfd);
+/* at exit: the buffers of threads that are still running, too */
+static void clear_all_buffers(void) {
+    trace_buf *b;
+
+    busy = 1;
+    for(b = __atomic_load_n(&all_bufs, __ATOMIC_ACQUIRE); b; b = b->next) {
+        if(b->len) clear_buffer(b);
+    }
 }
 
+/* thread exit: give the buffer to the next thread */
+static void release_buffer(void *arg) {
+    trace_buf *b = arg;
 
-static void mywrite(const char *fmt, ...) {
-    char buf[256];
-    va_list ap;
-    int len;
-    int i;
+    clear_buffer(b);
+    mybuf = NULL;
+    __atomic_store_n(&b->in_use, 0, __ATOMIC_RELEASE);
+}
 
-    va_start(ap, fmt);
-    len = vsprintf(buf, fmt, ap);
-    va_end(ap);
-    assert(len >= 0);
+/* fork: the records in the child's copy are the parent's to write */
+static void drop_parent_records(void) {
+    trace_buf *b;
 
-    for(i = 0; i <= len; i++) {
-        buffer[nbuffered][i] = buf[i];
-    }
-    nbuffered++;
-    if(nbuffered == BUFFER_LEN) {
-        clear_buffer();
+    mypid = getpid();
+    for(b = all_bufs; b; b = b->next) {
+        b->len = 0;
+        b->in_use = (b == mybuf);
     }
 }
 
-static const char *print_ptr(const void *p) {
-    /* realloc needs to print two pointers */
-    static char buf1[256];
-    static char buf2[256];
-    static char *which = buf1;
-    char *mine = which;
+static void init(void) {
+    const char *format = getenv("GENERATE_TRACE_FORMAT");
+
+    binary = format && !strcmp(format, "binary");
+    mypid = getpid();
+    pthread_key_create(&buf_key, release_buffer);
+    pthread_atfork(NULL, NULL, drop_parent_records);
+    atexit(clear_all_buffers);
+}
+
+static trace_buf *get_buffer(void) {
+    trace_buf *b;
 
+    pthread_once(&init_once, init);
+    for(b = __atomic_load_n(&all_bufs, __ATOMIC_ACQUIRE); b; b = b->next) {
+        int unused = 0;
+        if(__atomic_compare_exchange_n(&b->in_use, &unused, 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if(!b) {
+        b = mmap(NULL, sizeof(*b), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(b != MAP_FAILED);
+        b->in_use = 1;
+        b->next = __atomic_load_n(&all_bufs, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&all_bufs, &b->next, b, 0,
+                                           __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    mytid = (uint32_t) syscall(SYS_gettid);
+    pthread_setspecific(buf_key, b);
+    return b;
+}
+
+static int print_ptr(char *buf, const void *p) {
     if(p==0) {
-        sprintf(mine, "0");
+        return sprintf(buf, "0");
     } else {
-        sprintf(mine, "%p/%u", p, (unsigned) getpid());
+        return sprintf(buf, "%p/%u", p, (unsigned) mypid);
     }
-    which = (which == buf1) ? buf2 : buf1;
-    return mine;
 }
 
-static void init(void) {
-    atexit(clear_buffer_and_close);
+/*
+ * Timestamp of a binary record. free takes it before the block is
+ * given back, so a thread that gets the same address later sorts after
+ * it; malloc and calloc take it after they got their block, so they
+ * sort after the free that gave the address back.
+ */
+static uint64_t now(void) {
+    struct timespec ts;
+
+    if(!binary) return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-void *malloc(size_t sz) {
-    if(myheapend==0) init();
+static void record(char type, uint64_t time, const void *p, const void *oldp,
+                   size_t sz1, size_t sz2, void *caller) {
+    trace_buf *b;
+
+    if(busy) return;
+    busy = 1;
+    if(!mybuf) mybuf = get_buffer();
+    b = mybuf;
+
+    if(binary) {
+        trace_rec *r = (trace_rec *)(b->data + b->len);
+
+        r->time = time;
+        r->caller = (uintptr_t) caller;
+        r->ptr = (uintptr_t) p;
+        r->oldptr = (uintptr_t) oldp;
+        r->size = sz1;
+        r->size2 = sz2;
+        r->pid = mypid;
+        r->tid = mytid;
+        r->type = type;
+        b->len += sizeof(*r);
+    } else {
+        char *s = b->data + b->len;
+
+        s += sprintf(s, "%c ", type);
+        s += print_ptr(s, p);
+        if(type == 'r') {
+            *s++ = ' ';
+            s += print_ptr(s, oldp);
+        }
+        if(type == 'c') {
+            s += sprintf(s, " %zu %zu", sz1, sz2);
+        } else if(type != 'f') {
+            s += sprintf(s, " %zu", sz1);
+        }
+        *s++ = '\n';
+        b->len = s - b->data;
+    }
 
-    void *p = &memory[myheapend];
-    myheapend += ((sz-1) / sizeof(*memory)) + 1;
+    if(b->len > BUFFER_LEN - MAX_REC_LEN) {
+        clear_buffer(b);
+    }
+    busy = 0;
+}
+
+void *malloc(size_t sz) {
+    void *p = __libc_malloc(sz);
 
-    mywrite("m %s %u\n", print_ptr(p), sz);
+    record('m', now(), p, 0, sz, 0, __builtin_return_address(0));
     return p;
 }
 
 void *calloc(size_t sz1, size_t sz2) {
-    if(myheapend==0) init();
+    void *p = __libc_calloc(sz1, sz2);
 
-    size_t sz = sz1 * sz2;
-    char *p = (void*)&memory[myheapend];
-    int i;
-    myheapend += ((sz-1) / sizeof(*memory)) + 1;
-    for(i = 0; i < sz; i++) p[i] = 0;
-
-    mywrite("c %s %u %u\n", print_ptr(p), sz1, sz2);
+    record('c', now(), p, 0, sz1, sz2, __builtin_return_address(0));
     return p;
 }
 
+/*
+ * realloc both gives a block back and gets one, so a binary trace has
+ * two records for it: 'x' releases oldp before the call, like free,
+ * and 'r' takes p after it, like malloc. The converter pairs them up
+ * by thread.
+ */
 void *realloc(void *oldp, size_t sz) {
-    if(myheapend==0) init();
+    void *p;
 
-
-    char *p;
-    if(sz == 0) {
-        p = 0;
-    } else {
-        p = (void*)&memory[myheapend];
-        myheapend += ((sz-1) / sizeof(*memory)) + 1;
-    }
-
-    if(sz && oldp) {
-        int i;
-        memcpy(p, oldp, sz); /* clobbers after p; not a problem */
-        for(i = 0; i < sz; i++) p[i] = ((char*)oldp)[i];
+    if(binary) {
+        record('x', now(), oldp, 0, sz, 0, __builtin_return_address(0));
     }
-
-    mywrite("r %s %s %u\n", print_ptr(p), print_ptr(oldp), sz);
+    p = __libc_realloc(oldp, sz);
+    record('r', now(), p, oldp, sz, 0, __builtin_return_address(0));
     return p;
 }
 
 void free(void *p) {
-    if(myheapend==0) init();
-    mywrite("f %s\n", print_ptr(p));
+    record('f', now(), p, 0, 0, 0, __builtin_return_address(0));
+    __libc_free(p);
 }
@@ -0,0 +1,203 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Getopt::Std;
+
+#######################################################################
+# profile - derive mm.c size classes and CHUNKSIZE from trace files
+#
+# Replays the alloc/realloc/free requests of one or more trace files,
+# collects the histogram of adjusted block sizes (as computed by
+# adjust_size in mm.c) and the lifetime of every block in requests,
+# and prints a C header that mm.c uses when it is compiled with
+# -DSIZE_CLASS_PROFILE:
+#
+# - the boundaries of the segregated free lists, chosen so that every
+#   class receives about the same number of requests
+# - a table that maps asize / 8 to the class, so size_to_class is a
+#   single load
+# - CHUNKSIZE, rounded up from the block sizes that are requested
+#   while the live data is at a new high-water mark, i.e. the requests
+#   that grow the heap
+#
+# The histogram and the lifetime distribution are summarized in a
+# comment at the top of the header.
+#
+#######################################################################
+
+# Keep these in sync with mm.c
+my $WSIZE          = 4;
+my $ALIGNMENT      = 8;
+my $MIN_BLOCK_SIZE = 16;
+my $MMAP_THRESHOLD = 128 * 1024;
+my $MAX_CLASSES    = 64;    # free_bitmap is a size_t
+
+#
+# void usage(void) - print help message and terminate
+#
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-h] [-n <classes>] <tracefile>...\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h           Print this message\n";
+    printf STDERR "  -n <classes> Number of segregated free lists (default 9)\n";
+    die "\n";
+}
+
+sub adjust_size
+{
+    my $size = shift;
+    my $asize = ($size + $WSIZE + $ALIGNMENT - 1) & ~($ALIGNMENT - 1);
+    return $asize < $MIN_BLOCK_SIZE ? $MIN_BLOCK_SIZE : $asize;
+}
+
+# Value at fraction $q of a sorted list
+sub percentile
+{
+    my ($list, $q) = @_;
+    return 0 if !@$list;
+    my $i = int($q * (@$list - 1) + 0.5);
+    return $list->[$i];
+}
+
+##############
+# Main routine
+##############
+
+our ($opt_h, $opt_n);
+getopts('hn:');
+usage("") if $opt_h;
+usage("No trace files") if !@ARGV;
+
+my $num_classes = defined $opt_n ? $opt_n : 9;
+usage("Number of classes must be between 2 and $MAX_CLASSES")
+    if $num_classes < 2 || $num_classes > $MAX_CLASSES;
+
+my %hist;            # asize -> number of requests
+my @lifetimes;       # lifetime of every block, in requests
+my @growth_sizes;    # asize of the requests that raise the high-water mark
+my $total = 0;
+
+foreach my $file (@ARGV) {
+    open(my $fh, '<', $file) or die "$0: can't open $file: $!\n";
+
+    my %birth;       # id -> index of the request that allocated it
+    my %sizes;       # id -> asize
+    my $live = 0;
+    my $high = 0;
+    my $n = 0;
+    my $last_size = 0;
+
+    while (<$fh>) {
+        next if $. <= 4;
+        chomp;
+        my ($op, $id, $size) = split;
+        next if !defined $op;
+        $n++;
+
+        # Like mdriver, a request without a size reuses the previous one
+        if ($op ne 'f') {
+            $size = $last_size if !defined $size || $size eq '';
+            $last_size = $size;
+        }
+
+        if ($op eq 'f' || $op eq 'r') {
+            if (defined $sizes{$id}) {
+                push @lifetimes, $n - $birth{$id};
+                $live -= $sizes{$id};
+                delete $sizes{$id};
+            }
+        }
+        next if $op eq 'f' || $size == 0 || $size >= $MMAP_THRESHOLD;
+
+        # 'a' and the new block of 'r'
+        my $asize = adjust_size($size);
+        $hist{$asize}++;
+        $total++;
+        $birth{$id} = $n;
+        $sizes{$id} = $asize;
+        $live += $asize;
+        if ($live > $high) {
+            $high = $live;
+            push @growth_sizes, $asize;
+        }
+    }
+    # Blocks that are never freed live until the end of the trace
+    foreach my $id (keys %sizes) {
+        push @lifetimes, $n + 1 - $birth{$id};
+    }
+    close($fh);
+}
+die "$0: no requests below the mmap threshold\n" if !$total;
+
+#
+# Class boundaries: the i-th limit is the smallest asize at which the
+# cumulative request count reaches i / num_classes of the total.
+# Duplicate limits are merged, so there may be fewer classes.
+#
+my @limits;
+my $cum = 0;
+my $next = 1;
+foreach my $asize (sort { $a <=> $b } keys %hist) {
+    $cum += $hist{$asize};
+    while ($next < $num_classes && $cum * $num_classes >= $total * $next) {
+        push @limits, $asize if !@limits || $limits[-1] < $asize;
+        $next++;
+    }
+}
+# A limit equal to the largest asize seen would leave the last class
+# with no requests at all, so drop it and keep the top class non-empty
+pop @limits if @limits && $limits[-1] == (sort { $a <=> $b } keys %hist)[-1];
+@limits = ($MIN_BLOCK_SIZE) if !@limits;
+my $class_num = @limits + 1;
+my $class_max = $limits[-1];
+
+my @table;
+my $class = 0;
+for (my $asize = 0; $asize <= $class_max; $asize += $ALIGNMENT) {
+    $class++ while $asize > $limits[$class];
+    push @table, $class;
+}
+
+#
+# CHUNKSIZE: a power of two that covers 90% of the requests that grow
+# the heap, between one and sixteen pages.
+#
+@growth_sizes = sort { $a <=> $b } @growth_sizes;
+my $chunk = 4096;
+my $want = percentile(\@growth_sizes, 0.9);
+$chunk *= 2 while $chunk < $want && $chunk < 65536;
+
+@lifetimes = sort { $a <=> $b } @lifetimes;
+my @sorted = sort { $a <=> $b } keys %hist;
+
+print "/*\n";
+print " * mm-classes.h - generated by traces/profile.pl, do not edit\n";
+print " *\n";
+print " * traces: @ARGV\n";
+printf " * requests: %d, asize p50 %d p90 %d p99 %d max %d\n", $total,
+    percentile([map { ($_) x $hist{$_} } @sorted], 0.5),
+    percentile([map { ($_) x $hist{$_} } @sorted], 0.9),
+    percentile([map { ($_) x $hist{$_} } @sorted], 0.99),
+    $sorted[-1];
+printf " * lifetime in requests: p50 %d p90 %d p99 %d max %d\n",
+    percentile(\@lifetimes, 0.5), percentile(\@lifetimes, 0.9),
+    percentile(\@lifetimes, 0.99), $lifetimes[-1];
+printf " * heap growth requests: %d, asize p90 %d\n", scalar(@growth_sizes), $want;
+print " */\n";
+print "#ifndef __MM_CLASSES_H__\n";
+print "#define __MM_CLASSES_H__\n\n";
+print "#define CHUNKSIZE ($chunk)\n";
+print "#define SEGREGATED_FREE_LIST_NUM ($class_num)\n\n";
+print "/* inclusive upper bound of every class but the last one */\n";
+print "#define SEGREGATED_CLASS_LIMITS { ", join(", ", @limits), " }\n\n";
+print "/* class of asize, indexed by asize / 8, for asize <= SEGREGATED_CLASS_MAX */\n";
+print "#define SEGREGATED_CLASS_MAX ($class_max)\n";
+print "#define SEGREGATED_CLASS_TABLE { \\\n";
+for (my $i = 0; $i < @table; $i += 16) {
+    my $end = $i + 15 < $#table ? $i + 15 : $#table;
+    print "    ", join(", ", @table[$i .. $end]), ($end < $#table ? ", \\\n" : " \\\n");
+}
+print "}\n\n";
+print "#endif /* __MM_CLASSES_H__ */\n";